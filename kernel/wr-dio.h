@@ -34,6 +34,7 @@ enum wr_dio_cmd_name {
 	WR_DIO_CMD_STAMP,
 	WR_DIO_CMD_DAC,
 	WR_DIO_CMD_INOUT,
+	WR_DIO_CMD_STAMPS,	/* with struct wr_dio_stamps, not wr_dio_cmd */
 };
 
 /*
@@ -46,11 +47,12 @@ enum wr_dio_cmd_name {
  *     cmd->value: count of loops (0 to turn off)
  *
  *  CMD_STAMP:
- *     cmd->flags: F_MASK, F_WAIT
+ *     cmd->flags: F_MASK, F_WAIT (any channel in the mask), F_MULTI
  *     cmd->channel: the channel or the mask
- *     K: cmd->channel: the channel where we had stamps
+ *     K: cmd->channel: the channel where we had stamps (not if F_MULTI)
  *     K: cmd->nstamp: number of valid stamps
  *     K: cmd->t[]: the stamps
+ *     K: cmd->value: if F_MULTI, stamps per channel (WR_DIO_NSTAMP)
  *
  *  CMD_DAC:
  *     cmd->flags: none
@@ -62,6 +64,14 @@ enum wr_dio_cmd_name {
  *     cmd->channel: the channel or the mask
  *     cmd->value: bits 0..4: WR-DIO, 8..12 value, 16..20 OEN, 24..28 term
  *
+ *  CMD_STAMPS (struct wr_dio_stamps, below):
+ *     req->flags: F_WAIT (any channel in the mask)
+ *     req->channel: the mask
+ *     req->nstamp: the size of the stamps[] array
+ *     req->stamps: pointer to the array, as an integer
+ *     K: req->nstamp: number of valid stamps
+ *     K: stamps[]: the stamps, oldest first, with their channel
+ *
  */
 
 #define WR_DIO_INOUT_DIO	(1 << 0)
@@ -85,6 +95,86 @@ struct wr_dio_cmd {
 #define WR_DIO_F_MASK	0x04	/* Channel is 0x00..0x1f */
 #define WR_DIO_F_LOOP	0x08	/* Output should loop: t[2] is  looping*/
 #define WR_DIO_F_WAIT	0x10	/* Wait for event */
+#define WR_DIO_F_MULTI	0x20	/* Stamps from all channels in the mask */
+
+/*
+ * With F_MULTI, stamps are the oldest ones from the whole mask, grouped
+ * by channel in t[]: value tells how many each channel has, 5 bits each
+ */
+#define WR_DIO_NSTAMP_SHIFT(ch)		(5 * (ch))
+#define WR_DIO_NSTAMP(value, ch)	(((value) >> (5 * (ch))) & 0x1f)
+
+/*
+ * The "wr-dioN" char device returns input stamps with read(): an array
+ * of these records, oldest first, from all channels. It supports poll()
+ * and O_NONBLOCK. Stamps read there are not returned by CMD_STAMP.
+ * CMD_STAMPS returns the same records.
+ */
+struct wr_dio_stamp {
+	int64_t sec;
+	uint32_t nsec;
+	uint32_t channel;	/* 0..4 */
+};
+
+/*
+ * CMD_STAMPS returns any number of stamps in one call: the header is
+ * the same as struct wr_dio_cmd, but the stamps are in a user buffer.
+ */
+struct wr_dio_stamps {
+	uint16_t command;	/* WR_DIO_CMD_STAMPS */
+	uint16_t channel;	/* the mask, from user */
+	uint32_t value;		/* unused */
+	uint32_t flags;
+	uint32_t nstamp;	/* size of stamps[]; K: how many are valid */
+	uint64_t stamps;	/* (uintptr_t) of struct wr_dio_stamp [] */
+};
+
+/*
+ * Each channel collects stamps in a ring, that can be mapped by user
+ * space: mmap() the char device at offset "channel * page size", for
+ * WR_DIO_RING_BYTES(len). The length is the "dio_ring_len" module
+ * parameter, so map the header alone first to read it. The interrupt
+ * handler is the only producer: it writes the stamp and then increments
+ * head; the consumer reads stamps from tail up to head, and then
+ * increments tail. Indexes are free-running and len is a power of two,
+ * so slot is "index & (len-1)". If the ring is full, new stamps are
+ * dropped, and counted. Please use one consumer only, as the ring is
+ * shared with read() and CMD_STAMP. Stamps that read() or CMD_STAMP pop
+ * but can't copy to a bad user buffer are lost, and not counted.
+ */
+struct wr_dio_ring {
+	uint32_t head;		/* written by the kernel only */
+	uint32_t pad0[15];	/* head and tail in different cache lines */
+	uint32_t tail;		/* written by the consumer only */
+	uint32_t pad1[15];
+	uint32_t len;		/* number of stamps, a power of two */
+	uint32_t max_used;	/* high-water mark of head - tail */
+	uint64_t received;	/* stamps from the FIFO, dropped ones too */
+	uint64_t dropped;	/* stamps lost because the ring was full */
+	uint32_t pad2[10];
+	struct wr_dio_stamp s[];
+};
+#define WR_DIO_RING_LEN		512	/* default of "dio_ring_len" */
+#define WR_DIO_RING_BYTES(len) \
+	(sizeof(struct wr_dio_ring) + (len) * sizeof(struct wr_dio_stamp))
+
+#ifndef __KERNEL__
+/* Return the oldest stamp in a mapped ring, or NULL if it is empty */
+static inline struct wr_dio_stamp *wr_dio_ring_peek(struct wr_dio_ring *r)
+{
+	uint32_t tail = r->tail;
+
+	if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+		return NULL;
+	return r->s + (tail & (r->len - 1));
+}
+
+/* Release the stamp returned by wr_dio_ring_peek(), after using it */
+static inline void wr_dio_ring_pop(struct wr_dio_ring *r)
+{
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+#endif /* __KERNEL__ */
 
 
 #endif /* __WR_DIO_H__ */
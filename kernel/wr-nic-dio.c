@@ -15,13 +15,22 @@
 #include <linux/sched/signal.h>
 #endif
 #include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
 #include <linux/ktime.h>
 #include <linux/atomic.h>
+#include <linux/kref.h>
 #include <linux/platform_device.h>
 #include <linux/uaccess.h>
 #include <linux/fmc.h>
 #include <linux/fmc-sdb.h>
 #include <linux/rtnetlink.h>
+#include "spec.h"
 #include "spec-nic.h"
 #include "wr_nic/wr-nic.h"
 #include "wr-dio.h"
@@ -33,6 +42,39 @@
 #define wrn_stat 0
 #endif
 
+/* Stamps per channel: bursts longer than this are lost (and counted) */
+static int wrn_dio_ring_len = WR_DIO_RING_LEN;
+
+#define WRN_DIO_RING_MIN	16
+#define WRN_DIO_RING_MAX	(1 << 20) /* 16MB per channel */
+
+/* A bad length fails insmod, rather than leaving the card without DIO */
+static int wrn_dio_ring_len_set(const char *val,
+				const struct kernel_param *kp)
+{
+	int len, ret;
+
+	ret = kstrtoint(val, 0, &len);
+	if (ret)
+		return ret;
+	if (len < WRN_DIO_RING_MIN || len > WRN_DIO_RING_MAX
+	    || !is_power_of_2(len)) {
+		pr_err("%s: invalid dio_ring_len %i (power of two, "
+		       "%i to %i)\n", KBUILD_MODNAME, len, WRN_DIO_RING_MIN,
+		       WRN_DIO_RING_MAX);
+		return -EINVAL;
+	}
+	*(int *)kp->arg = len;
+	return 0;
+}
+
+static const struct kernel_param_ops wrn_dio_ring_len_ops = {
+	.set = wrn_dio_ring_len_set,
+	.get = param_get_int,
+};
+module_param_cb(dio_ring_len, &wrn_dio_ring_len_ops, &wrn_dio_ring_len,
+		0444);
+
 /*
  * FIXME (for the whole file: we use readl/writel, not fmc_read/fmc_writel)
  */
@@ -106,12 +148,15 @@ static struct regmap regmap[] = {
 	| DIO_EIC_ISR_NEMPTY_3\
 	| DIO_EIC_ISR_NEMPTY_4)
 
+#define WRN_DIO_ALL	0x1f /* mask of all channels */
+
 /* This is the structure we need to manage interrupts and loop internally */
-#define WRN_DIO_BUFFER_LEN  512
 struct dio_channel {
-	struct timespec tsbuf[WRN_DIO_BUFFER_LEN];
-	int bhead, btail;
-	wait_queue_head_t q;
+	struct wr_dio_ring *ring; /* vmalloc_user, as it can be mapped */
+
+	/* Our own copy of what user space may overwrite in the ring */
+	uint32_t head, len, max_used;
+	uint64_t received, dropped;
 
 	/* The input event may fire a new pulse on this or another channel */
 	struct timespec prevts, delay;
@@ -121,8 +166,191 @@ struct dio_channel {
 
 struct dio_device {
 	struct dio_channel ch[5];
+	spinlock_t lock; /* among consumers: the irq is the only producer */
+	wait_queue_head_t q; /* for any channel: waiters check their mask */
+	struct miscdevice mdev;
+	char name[IFNAMSIZ + 8];
+	int mdev_registered;
+	struct kref ref; /* the card, open files and ioctl waiters */
+	int gone; /* the card was removed: waiters return -ENODEV */
 };
 
+/*
+ * The rings are shared with user space (see wr-dio.h), so indexes are
+ * accessed once, and the consumer may write any tail: the producer
+ * only relies on it to see whether the ring is full. The head lives in
+ * the channel, and is only published to the ring: user space may
+ * overwrite the ring copy, but the kernel never reads it back.
+ */
+#define wrn_ring_get(x)		(*(volatile uint32_t *)&(x))
+#define wrn_ring_set(x, v)	(*(volatile uint32_t *)&(x) = (v))
+
+static int wrn_ring_pending(struct dio_channel *c)
+{
+	return wrn_ring_get(c->head) != wrn_ring_get(c->ring->tail);
+}
+
+/* Consumer side, with the lock held: return the oldest stamp or NULL */
+static struct wr_dio_stamp *__wrn_ring_peek(struct dio_channel *c)
+{
+	struct wr_dio_ring *r = c->ring;
+	uint32_t tail = wrn_ring_get(r->tail);
+
+	if (wrn_ring_get(c->head) == tail)
+		return NULL;
+	smp_rmb(); /* read the stamp after the head that published it */
+	return r->s + (tail & (c->len - 1));
+}
+
+static void __wrn_ring_pop(struct dio_channel *c)
+{
+	smp_mb(); /* we read the stamp, before the producer reuses it */
+	wrn_ring_set(c->ring->tail, wrn_ring_get(c->ring->tail) + 1);
+}
+
+/* Producer side, in the interrupt handler */
+static void wrn_ring_push(struct dio_channel *c, int ch, struct timespec *ts)
+{
+	struct wr_dio_ring *r = c->ring;
+	uint32_t head = c->head, used; /* r->head is only written */
+	struct wr_dio_stamp *s;
+
+	r->received = ++c->received;
+	used = head - wrn_ring_get(r->tail);
+	if (used >= c->len) {
+		/* full, or a bogus tail from user space */
+		r->dropped = ++c->dropped;
+		return;
+	}
+	s = r->s + (head & (c->len - 1));
+	s->sec = ts->tv_sec;
+	s->nsec = ts->tv_nsec;
+	s->channel = ch;
+	if (used + 1 > c->max_used)
+		c->max_used = used + 1;
+	r->max_used = c->max_used;
+	smp_wmb(); /* the stamp is there before head says so */
+	wrn_ring_set(c->head, head + 1);
+	wrn_ring_set(r->head, head + 1);
+}
+
+/*
+ * Return the oldest stamps first, from the channels in the mask, so it
+ * merges the rings (for read and CMD_STAMP). Called with the lock held.
+ */
+static int __wrn_dio_pull(struct dio_device *d, int mask,
+			  struct wr_dio_stamp *s, int n)
+{
+	struct dio_channel *c, *oldest;
+	struct wr_dio_stamp *st, *stold = NULL;
+	int ch, i;
+
+	for (i = 0; i < n; i++) {
+		oldest = NULL;
+		for (ch = 0, c = d->ch; ch < ARRAY_SIZE(d->ch); ch++, c++) {
+			if (((1 << ch) & mask) == 0)
+				continue;
+			st = __wrn_ring_peek(c);
+			if (!st)
+				continue;
+			if (!oldest || st->sec < stold->sec
+			    || (st->sec == stold->sec
+				&& st->nsec < stold->nsec)) {
+				oldest = c;
+				stold = st;
+			}
+		}
+		if (!oldest)
+			break;
+		s[i] = *stold;
+		s[i].channel = oldest - d->ch; /* don't trust user memory */
+		__wrn_ring_pop(oldest);
+	}
+	return i;
+}
+
+static int wrn_dio_pending(struct dio_device *d, int mask)
+{
+	int ch;
+
+	for (ch = 0; ch < ARRAY_SIZE(d->ch); ch++)
+		if (((1 << ch) & mask) && wrn_ring_pending(d->ch + ch))
+			return 1;
+	return 0;
+}
+
+#define WRN_DIO_PULL_BATCH 16 /* on the stack, then copied to user */
+
+/*
+ * Copy up to n stamps to user space (read, CMD_STAMPS): return how many.
+ * Stamps are popped before the copy (it can't be done under the lock),
+ * so those that fault are lost: they are not counted as "dropped"
+ */
+static ssize_t wrn_dio_pull_user(struct dio_device *d, int mask,
+				 struct wr_dio_stamp __user *buf, size_t n)
+{
+	struct wr_dio_stamp s[WRN_DIO_PULL_BATCH];
+	size_t done = 0, left;
+	int i;
+
+	while (done < n) {
+		i = min_t(size_t, n - done, ARRAY_SIZE(s));
+		spin_lock(&d->lock);
+		i = __wrn_dio_pull(d, mask, s, i);
+		spin_unlock(&d->lock);
+		if (!i)
+			break;
+		left = copy_to_user(buf + done, s, i * sizeof(*s));
+		if (left) {
+			done += i - DIV_ROUND_UP(left, sizeof(*s));
+			return done ? done : -EFAULT;
+		}
+		done += i;
+	}
+	return done;
+}
+
+static void wrn_dio_free(struct dio_device *d)
+{
+	int i;
+
+	/* Mapped pages are refcounted, and survive until munmap */
+	for (i = 0; i < ARRAY_SIZE(d->ch); i++)
+		vfree(d->ch[i].ring);
+	kfree(d);
+}
+
+/* Called on the last put: the card is gone, and no file uses it */
+static void wrn_dio_kref_release(struct kref *ref)
+{
+	wrn_dio_free(container_of(ref, struct dio_device, ref));
+}
+
+/*
+ * HACK: since 2.1.68 (Nov 1997) the ioctl is called locked.
+ * So we need to unlock, but that is dangerous for rmmod.
+ * Let's thus increase the module usage while sleeping, and
+ * keep a reference to the device, that may be removed meanwhile
+ */
+static int wrn_dio_ioctl_wait(struct dio_device *d, int mask)
+{
+	int gone;
+
+	kref_get(&d->ref);
+	try_module_get(THIS_MODULE);
+	rtnl_unlock();
+	wait_event_interruptible(d->q, wrn_dio_pending(d, mask) || d->gone);
+	rtnl_lock();
+	gone = d->gone;
+	kref_put(&d->ref, wrn_dio_kref_release);
+	module_put(THIS_MODULE);
+	if (gone)
+		return -ENODEV;
+	if (signal_pending(current))
+		return -ERESTARTSYS;
+	return 0;
+}
+
 /* Instead of timespec_sub, just subtract the nanos */
 static inline void wrn_ts_sub(struct timespec *ts, int nano)
 {
@@ -213,64 +441,69 @@ static int wrn_dio_cmd_stamp(struct wrn_drvdata *drvdata,
 			     struct wr_dio_cmd *cmd)
 {
 	struct dio_device *d = drvdata->mezzanine_data;
-	struct dio_channel *c = 0;
-	struct timespec *ts = cmd->t;
-	struct regmap *map;
-	int mask, ch, last;
-	int nstamp = 0;
+	struct wr_dio_stamp stamps[WR_DIO_N_STAMP], *s;
+	struct dio_channel *c;
+	struct timespec *ts;
+	int mask, ch, i, count;
+	int nstamp, ret;
 
-	if ((cmd->flags & (WR_DIO_F_MASK || WR_DIO_F_WAIT))
-	    == (WR_DIO_F_MASK || WR_DIO_F_WAIT))
-		return -EINVAL; /* wait on several channels not supported */
+	if (cmd->flags & WR_DIO_F_MASK)
+		mask = cmd->channel & WRN_DIO_ALL;
+	else if (cmd->channel < ARRAY_SIZE(d->ch))
+		mask = 1 << cmd->channel;
+	else
+		return -EINVAL;
 
 again:
-	if (cmd->flags & WR_DIO_F_MASK) {
-		ch = 0;
-		last = 4;
-		mask = cmd->channel;
+	nstamp = 0;
+	ts = cmd->t;
+	if (cmd->flags & WR_DIO_F_MULTI) {
+		/* Oldest first from all channels, then grouped by channel */
+		spin_lock(&d->lock);
+		nstamp = __wrn_dio_pull(d, mask, stamps, WR_DIO_N_STAMP);
+		spin_unlock(&d->lock);
+		cmd->value = 0;
+		for (ch = 0; ch < ARRAY_SIZE(d->ch); ch++) {
+			for (i = count = 0; i < nstamp; i++) {
+				if (stamps[i].channel != ch)
+					continue;
+				ts->tv_sec = stamps[i].sec;
+				ts->tv_nsec = stamps[i].nsec;
+				ts++;
+				count++;
+			}
+			cmd->value |= count << WR_DIO_NSTAMP_SHIFT(ch);
+		}
 	} else {
-		ch = cmd->channel;
-		last = ch;
-		mask = (1 << ch);
-	}
-	/* handle the 1-channel and mask case in the same loop */
-	c = d->ch + ch;
-	for (; ch <= last; ch++, c++) {
-		if (((1 << ch) & mask) == 0)
-			continue;
-		map = regmap + ch;
-		while (1) {
-			if (nstamp == WR_DIO_N_STAMP)
-				break;
-			if (c->bhead == c->btail)
+		/* Stamps from the first channel in the mask that has any */
+		for (ch = 0, c = d->ch; ch < ARRAY_SIZE(d->ch); ch++, c++) {
+			if (((1 << ch) & mask) == 0)
+				continue;
+			spin_lock(&d->lock);
+			while (nstamp < WR_DIO_N_STAMP) {
+				s = __wrn_ring_peek(c);
+				if (!s)
+					break;
+				ts->tv_sec = s->sec;
+				ts->tv_nsec = s->nsec;
+				__wrn_ring_pop(c);
+				nstamp++;
+				ts++;
+			}
+			spin_unlock(&d->lock);
+			if (nstamp) {
+				cmd->channel = ch;
 				break;
-			*ts = c->tsbuf[c->btail];
-			c->btail = (c->btail + 1) % WRN_DIO_BUFFER_LEN;
-			nstamp++;
-			ts++;
-		}
-		if (nstamp) {
-			cmd->channel = ch;
-			break;
+			}
 		}
 	}
 	cmd->nstamp = nstamp;
 
-	/* The user may asketo wait for timestamps, but for 1 channel only */
+	/* The user may ask to wait for timestamps, on any channel of mask */
 	if (!nstamp && cmd->flags & WR_DIO_F_WAIT) {
-		ch--; c--; /* The for above incremeted them */
-		/*
-		 * HACK: since 2.1.68 (Nov 1997) the ioctl is called locked.
-		 * So we need to unlock, but that is dangerous for rmmod.
-		 * Let's thus increase the module usage while sleeping
-		 */
-		try_module_get(THIS_MODULE);
-		rtnl_unlock();
-		wait_event_interruptible(c->q, c->bhead != c->btail);
-		rtnl_lock();
-		module_put(THIS_MODULE);
-		if (signal_pending(current))
-			return -ERESTARTSYS;
+		ret = wrn_dio_ioctl_wait(d, mask);
+		if (ret)
+			return ret;
 		goto again;
 	}
 
@@ -279,6 +512,40 @@ again:
 	return 0;
 }
 
+/* This has its own structure, to return any number of stamps at once */
+static int wrn_dio_cmd_stamps(struct wrn_drvdata *drvdata,
+			      struct wr_dio_stamps __user *ureq)
+{
+	struct dio_device *d = drvdata->mezzanine_data;
+	struct wr_dio_stamps req;
+	struct wr_dio_stamp __user *buf;
+	ssize_t n;
+	int mask, ret;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+	mask = req.channel & WRN_DIO_ALL;
+	if (!mask || !req.nstamp || req.flags & ~WR_DIO_F_WAIT)
+		return -EINVAL;
+	buf = (struct wr_dio_stamp __user *)(unsigned long)req.stamps;
+
+	while (1) {
+		n = wrn_dio_pull_user(d, mask, buf, req.nstamp);
+		if (n < 0)
+			return n;
+		if (n)
+			break;
+		if (!(req.flags & WR_DIO_F_WAIT))
+			return -EAGAIN;
+		ret = wrn_dio_ioctl_wait(d, mask);
+		if (ret)
+			return ret;
+	}
+	if (put_user((uint32_t)n, &ureq->nstamp))
+		return -EFAULT;
+	return 0;
+}
+
 static int wrn_dio_cmd_inout(struct wrn_drvdata *drvdata,
 			     struct wr_dio_cmd *cmd)
 {
@@ -336,8 +603,9 @@ static int wrn_dio_cmd_inout(struct wrn_drvdata *drvdata,
 int wrn_mezzanine_ioctl(struct net_device *dev, struct ifreq *rq,
 			       int ioctlcmd)
 {
-	struct wr_dio_cmd *cmd;
+	struct wr_dio_cmd *cmd = NULL;
 	struct wrn_drvdata *drvdata = dev->dev.parent->platform_data;
+	uint16_t command;
 	ktime_t t, t0;
 	int ret;
 
@@ -345,15 +613,27 @@ int wrn_mezzanine_ioctl(struct net_device *dev, struct ifreq *rq,
 		return -EAGAIN; /* Special marker */
 	if (ioctlcmd != PRIV_MEZZANINE_CMD)
 		return -ENOIOCTLCMD;
+	if (!drvdata->mezzanine_data)
+		return -ENODEV; /* being removed */
 
 	if (wrn_stat) {
 		t0 = ktime_get();
 	}
 
+	/* Both structures begin with the command, the batch one is smaller */
+	ret = -EFAULT;
+	if (get_user(command, (uint16_t __user *)rq->ifr_data))
+		goto out;
+	if (command == WR_DIO_CMD_STAMPS) {
+		ret = wrn_dio_cmd_stamps(drvdata, rq->ifr_data);
+		goto out;
+	}
+
 	/* The cmd struct can't fit in the stack, so allocate it */
+	ret = -ENOMEM;
 	cmd = kmalloc(sizeof(*cmd), GFP_KERNEL);
 	if (!cmd)
-		return -ENOMEM;
+		goto out;
 	ret = -EFAULT;
 	if (copy_from_user(cmd, rq->ifr_data, sizeof(*cmd)))
 		goto out;
@@ -377,7 +657,7 @@ int wrn_mezzanine_ioctl(struct net_device *dev, struct ifreq *rq,
 	}
 
 	if (copy_to_user(rq->ifr_data, cmd, sizeof(*cmd)))
-		return -EFAULT;
+		ret = -EFAULT;
 out:
 	kfree(cmd);
 
@@ -418,10 +698,10 @@ irqreturn_t wrn_dio_interrupt(struct fmc_device *fmc)
 	static ktime_t t_ini, t_end;
 	static int rate_avg;
 	struct dio_channel *c;
-	struct timespec *ts;
+	struct timespec ts;
 	struct regmap *map;
 	uint32_t mask, reg;
-	int ch, chm;
+	int ch, chm, got;
 
 	if (unlikely(!fmc->eeprom)) {
 		dev_err(fmc->hwdev, "WR-DIO: No mezzanine, disabling irqs\n");
@@ -430,6 +710,13 @@ irqreturn_t wrn_dio_interrupt(struct fmc_device *fmc)
 		return IRQ_NONE;
 	}
 
+	/* Not there yet, or being removed: nobody would take the stamps */
+	if (unlikely(!d || d->gone)) {
+		writel(~0, &dio->EIC_IDR);
+		writel(~0, &dio->EIC_ISR);
+		return IRQ_NONE;
+	}
+
 	/* Protect against interrupts taking 100% of cpu time */
 	if (ktime_to_ns(t_end)) {
 		int rate;
@@ -457,61 +744,165 @@ irqreturn_t wrn_dio_interrupt(struct fmc_device *fmc)
 
 	/* Three indexes: channel, channel-mask, channel pointer */
 	for (ch = 0, chm = 1, c = d->ch; mask; ch++, chm <<= 1, c++) {
-		int h;
-
 		if (!(mask & chm))
 			continue;
 		mask &= ~chm;
 
-		/* Pull the FIFOs to the device structure */
+		/* Pull the FIFOs to the ring, that user space may map */
 		map = regmap + ch;
-		ts = NULL;
+		got = 0;
 		while (1) {
 			reg = readl(base + map->fifo_status);
 			if (reg & 0x20000) /* empty */
 				break;
-			h = c->bhead;
-			ts = c->tsbuf + h;
-			c->bhead = (h + 1) % WRN_DIO_BUFFER_LEN;
-			if (c->bhead == c->btail)
-				c->btail = (c->btail + 1) % WRN_DIO_BUFFER_LEN;
 			/*
 			 * fifo is not-empty, pick one sample. Read
 			 * cycles last, as that operation pops the FIFO
 			 */
-			ts->tv_sec = 0;
-			SET_HI32(ts->tv_sec, readl(base + map->fifo_tai_h));
-			ts->tv_sec |= readl(base + map->fifo_tai_l);
-			ts->tv_nsec = 8 * readl(base + map->fifo_cycle);
+			ts.tv_sec = 0;
+			SET_HI32(ts.tv_sec, readl(base + map->fifo_tai_h));
+			ts.tv_sec |= readl(base + map->fifo_tai_l);
+			ts.tv_nsec = 8 * readl(base + map->fifo_cycle);
 			/* subtract 5 cycles lost in input sync circuits */
-			wrn_ts_sub(ts, 40);
+			wrn_ts_sub(&ts, 40);
+			wrn_ring_push(c, ch, &ts);
+			got = 1;
 		}
 		writel(chm, &dio->EIC_ISR); /* ack */
-		if (ts && atomic_read(&c->count) != 0) {
-			wrn_trig_next_pulse(drvdata, ch, c, ts);
+		if (got && atomic_read(&c->count) != 0) {
+			wrn_trig_next_pulse(drvdata, ch, c, &ts);
 		}
-		wake_up_interruptible(&c->q);
 	}
+	wake_up_interruptible(&d->q);
 	t_end = ktime_get();
 	return IRQ_HANDLED;
 }
 
+/*
+ * The char device: read returns stamps from all channels, oldest first.
+ * Open runs under the misc lock, so it can't race with misc_deregister
+ */
+static int wrn_dio_open(struct inode *inode, struct file *f)
+{
+	struct miscdevice *mdev = f->private_data;
+	struct dio_device *d = container_of(mdev, struct dio_device, mdev);
+
+	kref_get(&d->ref);
+	f->private_data = d;
+	return nonseekable_open(inode, f);
+}
+
+static int wrn_dio_release(struct inode *inode, struct file *f)
+{
+	struct dio_device *d = f->private_data;
+
+	kref_put(&d->ref, wrn_dio_kref_release);
+	return 0;
+}
+
+static ssize_t wrn_dio_read(struct file *f, char __user *buf,
+			    size_t count, loff_t *offp)
+{
+	struct dio_device *d = f->private_data;
+	const size_t size = sizeof(struct wr_dio_stamp);
+	ssize_t n;
+	int ret;
+
+	if (count < size)
+		return -EINVAL;
+	while (1) {
+		n = wrn_dio_pull_user(d, WRN_DIO_ALL, (void __user *)buf,
+				      count / size);
+		if (n)
+			return n < 0 ? n : n * size;
+		/* Nothing yet, or another reader was faster than us */
+		if (d->gone)
+			return -ENODEV;
+		if (f->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(d->q,
+					       wrn_dio_pending(d, WRN_DIO_ALL)
+					       || d->gone);
+		if (ret)
+			return ret;
+	}
+}
+
+static unsigned int wrn_dio_poll(struct file *f, poll_table *wait)
+{
+	struct dio_device *d = f->private_data;
+
+	poll_wait(f, &d->q, wait);
+	if (wrn_dio_pending(d, WRN_DIO_ALL))
+		return POLLIN | POLLRDNORM;
+	if (d->gone)
+		return POLLERR | POLLHUP;
+	return 0;
+}
+
+/* The page offset is the channel: each ring is mapped on its own */
+static int wrn_dio_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	struct dio_device *d = f->private_data;
+	unsigned long ch = vma->vm_pgoff;
+
+	if (d->gone)
+		return -ENODEV;
+	if (ch >= ARRAY_SIZE(d->ch))
+		return -EINVAL;
+	return remap_vmalloc_range(vma, d->ch[ch].ring, 0);
+}
+
+static const struct file_operations wrn_dio_fops = {
+	.owner = THIS_MODULE,
+	.open = wrn_dio_open,
+	.release = wrn_dio_release,
+	.read = wrn_dio_read,
+	.poll = wrn_dio_poll,
+	.mmap = wrn_dio_mmap,
+	.llseek = no_llseek,
+};
+
 /* Init and exit below are called when a netdevice is created/destroyed */
 int wrn_mezzanine_init(struct net_device *dev)
 {
 	struct wrn_drvdata *drvdata = dev->dev.parent->platform_data;
 	struct DIO_WB __iomem *dio = drvdata->wrdio_base;
 	struct dio_device *d;
+	size_t size;
 	int i;
 
 	/* Allocate the data structure and enable interrupts for stamping */
 	d = kzalloc(sizeof(*d), GFP_KERNEL);
 	if (!d)
 		return -ENOMEM;
-	for (i = 0; i < ARRAY_SIZE(d->ch); i++)
-		init_waitqueue_head(&d->ch[i].q);
+	size = PAGE_ALIGN(WR_DIO_RING_BYTES(wrn_dio_ring_len));
+	for (i = 0; i < ARRAY_SIZE(d->ch); i++) {
+		d->ch[i].ring = vmalloc_user(size);
+		if (!d->ch[i].ring) {
+			wrn_dio_free(d);
+			return -ENOMEM;
+		}
+		d->ch[i].len = wrn_dio_ring_len;
+		d->ch[i].ring->len = wrn_dio_ring_len;
+	}
+	spin_lock_init(&d->lock);
+	init_waitqueue_head(&d->q);
+	kref_init(&d->ref);
 	drvdata->mezzanine_data = d;
 
+	/* The char device is named after the card, like the time page */
+	snprintf(d->name, sizeof(d->name), "wr-dio%i",
+		 to_platform_device(dev->dev.parent)->id);
+	d->mdev.minor = MISC_DYNAMIC_MINOR;
+	d->mdev.name = d->name;
+	d->mdev.fops = &wrn_dio_fops;
+	d->mdev.parent = dev->dev.parent;
+	if (misc_register(&d->mdev) == 0)
+		d->mdev_registered = 1;
+	else
+		dev_warn(&dev->dev, "can't register %s\n", d->name);
+
 	/*
 	 * Enable interrupts for FIFO, if there's no mezzanine the
 	 * handler will notice and disable the interrupts
@@ -524,9 +915,29 @@ void wrn_mezzanine_exit(struct net_device *dev)
 {
 	struct wrn_drvdata *drvdata = dev->dev.parent->platform_data;
 	struct DIO_WB __iomem *dio = drvdata->wrdio_base;
+	struct dio_device *d = drvdata->mezzanine_data;
+	struct spec_dev *spec = drvdata->fmc->carrier_data;
 
+	/* The handler may still be running on another cpu, using d */
 	writel(~0, &dio->EIC_IDR);
-	if (drvdata->mezzanine_data)
-		kfree(drvdata->mezzanine_data);
+	synchronize_irq(spec->pdev->irq);
+	if (!d)
+		return;
+
+	/*
+	 * No new files after this. The ioctl looks for d under rtnl, and
+	 * checks "gone" under rtnl when it wakes up, so it can go on
+	 * using d until it returns
+	 */
+	if (d->mdev_registered)
+		misc_deregister(&d->mdev);
+	rtnl_lock();
+	drvdata->mezzanine_data = NULL;
+	d->gone = 1;
+	rtnl_unlock();
+
+	/* Sleepers return -ENODEV; the last one to leave frees it all */
+	wake_up_interruptible_all(&d->q);
+	kref_put(&d->ref, wrn_dio_kref_release);
 }
 
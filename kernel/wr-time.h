@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ *
+ * Released according to the GNU GPL, version 2 or any later version.
+ *
+ * This work is part of the White Rabbit project, a research effort led
+ * by CERN, the European Institute for Nuclear Research.
+ */
+#ifndef __WR_TIME_H__
+#define __WR_TIME_H__
+/* This should be included by both the kernel and the tools */
+
+#ifndef __KERNEL__
+#include <stdint.h>
+#endif
+
+/*
+ * The "wr-timeN" misc device can be mapped read-only (one page, offset
+ * 0). The driver refreshes the snapshot every 100ms: it tells the WR
+ * time at a given CLOCK_MONOTONIC time of the host, and the rate of WR
+ * time against the host clock, so user space can extrapolate WR time
+ * from clock_gettime() alone, without system calls or card accesses.
+ *
+ * The sequence count is odd while the driver updates the page: readers
+ * must retry if it is odd, or if it changed during the read.
+ */
+struct wr_time_page {
+	uint32_t seq;
+	uint32_t flags;
+	int64_t host_ns;	/* CLOCK_MONOTONIC at the snapshot */
+	int64_t offset_ns;	/* WR time minus host time, at host_ns */
+	int32_t rate_ppb;	/* WR rate against the host clock */
+	uint32_t wr_nsec;	/* WR time at host_ns: nanoseconds... */
+	uint64_t wr_sec;	/* ...and seconds (40 bits) */
+	uint64_t updates;
+};
+
+#define WR_TIME_F_VALID	0x01	/* A snapshot is there */
+#define WR_TIME_F_RATE	0x02	/* rate_ppb is measured, not just 0 */
+
+#ifndef __KERNEL__
+/* Return WR time (ns) at the given CLOCK_MONOTONIC time, or -1 */
+static inline int64_t wr_time_page_ns(volatile struct wr_time_page *p,
+				      int64_t host_ns)
+{
+	uint32_t seq, flags;
+	int64_t base, offset;
+	int32_t rate;
+
+	do {
+		seq = p->seq;
+		__sync_synchronize();
+		flags = p->flags;
+		base = p->host_ns;
+		offset = p->offset_ns;
+		rate = p->rate_ppb;
+		__sync_synchronize();
+	} while ((seq & 1) || seq != p->seq);
+
+	if (!(flags & WR_TIME_F_VALID))
+		return -1;
+	return host_ns + offset + (host_ns - base) * rate / 1000000000LL;
+}
+#endif /* __KERNEL__ */
+
+#endif /* __WR_TIME_H__ */
@@ -20,11 +20,25 @@
 #include <linux/spinlock.h>
 #include <linux/delay.h>
 #include <linux/io.h>
+#include <linux/slab.h>
 
 #include "wr-nic.h"
 #include "nic-mem.h"
 #include "../spec-nic.h"
 
+/* Release the skbs still pending in the tx ring */
+static void __wrn_free_tx_ring(struct wrn_dev *wrn)
+{
+	struct sk_buff *skb;
+	int i;
+
+	for (i = 0; i < WRN_NR_TXDESC; i++) {
+		skb = xchg(&wrn->skb_desc[i].skb, NULL);
+		if (skb)
+			dev_kfree_skb_any(skb);
+	}
+}
+
 /* The remove function is used by probe, so it's not __devexit */
 static int wrn_remove(struct platform_device *pdev)
 {
@@ -38,8 +52,21 @@ static int wrn_remove(struct platform_device *pdev)
 	spin_unlock(&wrn->lock);
 #endif
 
-	/* First of all, stop any transmission */
+	wrn_ptp_exit(wrn);
+	wrn_timepage_exit(wrn);
+
+	/* First of all, stop any transmission, and the interrupts */
 	writel(0, &wrn->regs->CR);
+	writel(WRN_IRQ_ALL, (void *)wrn->regs + 0x20 /* EIC_IDR */);
+	writel(TXTSU_EIC_IDR_NEMPTY, &wrn->txtsu_regs->EIC_IDR);
+
+	/* Then wait for a running rx poll, and prevent new ones */
+	if (wrn->napi_enabled) {
+		napi_disable(&wrn->napi);
+		netif_napi_del(&wrn->napi);
+		wrn->napi_enabled = 0;
+	}
+	wrn_rx_pool_free(wrn);
 
 	/* Then remove devices, memory maps, interrupts */
 	for (i = 0; i < WRN_NR_ENDPOINTS; i++) {
@@ -50,6 +77,8 @@ static int wrn_remove(struct platform_device *pdev)
 			wrn->dev[i] = NULL;
 		}
 	}
+	del_timer_sync(&wrn->tstamp_timer);
+	__wrn_free_tx_ring(wrn);
 
 	for (i = 0; i < ARRAY_SIZE(wrn->bases); i++) {
 		if (wrn->bases[i])
@@ -98,6 +127,30 @@ static int __wrn_map_resources(struct platform_device *pdev)
 	return 0;
 }
 
+/* Program all descriptors: rx ones are given their buffer slot */
+static void __wrn_init_rings(struct wrn_dev *wrn)
+{
+	struct wrn_txd __iomem *tx;
+	struct wrn_rxd __iomem *rx;
+	int i, offset;
+
+	for (i = 0; i < WRN_NR_TXDESC; i++) { /* Clear all tx descriptors */
+		tx = wrn->txd + i;
+		writel(0, &tx->tx1);
+	}
+
+	/* Now, prepare RX descriptors */
+	for (i = 0; i < WRN_NR_RXDESC; i++) {
+		rx = wrn->rxd + i;
+		offset = __wrn_desc_offset(wrn, WRN_DDIR_RX, i);
+		writel((2000 << 16) | offset, &rx->rx3);
+		writel(NIC_RX1_D1_EMPTY, &rx->rx1);
+	}
+
+	wrn->next_tx_head = wrn->next_tx_tail = wrn->next_rx = 0;
+	atomic_set(&wrn->tx_count, 0);
+}
+
 static int wrn_probe(struct platform_device *pdev)
 {
 	struct net_device *netdev;
@@ -125,6 +178,9 @@ static int wrn_probe(struct platform_device *pdev)
 	}
 	spin_unlock(&wrn->lock);
 #endif
+	spin_lock_init(&wrn->lock);
+	wrn_tstamp_setup(wrn);
+
 	/* Map our resource list and instantiate the shortcut pointers */
 	err = __wrn_map_resources(pdev);
 	if (err)
@@ -135,7 +191,6 @@ static int wrn_probe(struct platform_device *pdev)
 	wrn->txd = ((void *)wrn->regs) + 0x80; /* was: TX1_D1 */
 	wrn->rxd = ((void *)wrn->regs) + 0x100; /* was: RX1_D1 */
 	wrn->databuf = (void *)wrn->regs + offsetof(struct NIC_WB, MEM);
-	tasklet_init(&wrn->rx_tlet, wrn_rx_interrupt, (unsigned long)wrn);
 	if (0)
 		dev_info(&pdev->dev, "regs %p, txd %p, rxd %p, buffer %p\n",
 			 wrn->regs, wrn->txd, wrn->rxd, wrn->databuf);
@@ -154,6 +209,20 @@ static int wrn_probe(struct platform_device *pdev)
 	writel(0, &wrn->regs->CR);
 	mdelay(10);
 
+	__wrn_init_rings(wrn);
+
+	/*
+	 * Rx and tx-done are napi-driven, hosted by a dummy device. The
+	 * napi must be there before the interfaces, as they can be opened
+	 * as soon as they are registered
+	 */
+	wrn_rx_pool_fill(wrn);
+	init_dummy_netdev(&wrn->napi_dev);
+	netif_napi_add(&wrn->napi_dev, &wrn->napi, wrn_poll,
+		       WRN_NAPI_WEIGHT);
+	napi_enable(&wrn->napi);
+	wrn->napi_enabled = 1;
+
 	/* Finally, register one interface per endpoint */
 	memset(wrn->dev, 0, sizeof(wrn->dev));
 	for (i = 0; i < WRN_NR_ENDPOINTS; i++) {
@@ -187,37 +256,25 @@ static int wrn_probe(struct platform_device *pdev)
 			dev_err(&pdev->dev,
 				"Init mezzanine code: error %i\n", err);
 	}
-	if (i == 0)
-		return -ENODEV; /* no endpoints */
-
-	for (i = 0; i < WRN_NR_TXDESC; i++) { /* Clear all tx descriptors */
-		struct wrn_txd *tx;
-
-		tx = wrn->txd + i;
-		writel(0, &tx->tx1);
-	}
-
-	/* Now, prepare RX descriptors */
-	for (i = 0; i < WRN_NR_RXDESC; i++) {
-		struct wrn_rxd *rx;
-		int offset;
-
-		rx = wrn->rxd + i;
-		offset = __wrn_desc_offset(wrn, WRN_DDIR_RX, i);
-		writel((2000 << 16) | offset, &rx->rx3);
-		writel(NIC_RX1_D1_EMPTY, &rx->rx1);
+	if (i == 0) {
+		err = -ENODEV; /* no endpoints */
+		goto out;
 	}
 
-	/*
-	 * make sure all head/tail are 0 -- not needed here, but if we
-	 * disable and then re-enable, this _is_ needed
-	 */
-	wrn->next_tx_head = wrn->next_tx_tail = wrn->next_rx = 0;
-
 	writel(NIC_CR_RX_EN | NIC_CR_TX_EN, &wrn->regs->CR);
 	writel(WRN_IRQ_ALL, (void *)wrn->regs + 0x24 /* EIC_IER */);
 
 	wrn_tstamp_init(wrn);
+
+	/* The ptp clock is not needed for networking: don't fail */
+	err = wrn_ptp_init(wrn, &pdev->dev);
+	if (err)
+		dev_warn(&pdev->dev, "Can't register ptp clock: error %i\n",
+			 err);
+	err = wrn_timepage_init(wrn, &pdev->dev);
+	if (err)
+		dev_warn(&pdev->dev, "Can't register time page: error %i\n",
+			 err);
 	err = 0;
 out:
 	if (err) {
@@ -239,3 +296,16 @@ struct platform_driver wrn_driver = {
 		.owner		= THIS_MODULE,
 	},
 };
+
+/* If the kernel has no ptp clocks, these weak ones apply */
+int __weak wrn_ptp_init(struct wrn_dev *wrn, struct device *parent)
+{
+	return 0;
+}
+void __weak wrn_ptp_exit(struct wrn_dev *wrn)
+{
+}
+int __weak wrn_ptp_index(struct wrn_dev *wrn)
+{
+	return -1;
+}
@@ -250,7 +250,7 @@ int wrn_endpoint_probe(struct net_device *dev)
 	dev_alloc_name(dev, "wr%d");
 	wrn_netops_init(dev); /* function in ./nic-core.c */
 	wrn_ethtool_init(dev); /* function in ./ethtool.c */
-	/* Napi is not supported on this device */
+	/* Napi is per-nic, not per-endpoint: see wrn_probe() */
 
 	ep->mii.dev = dev;		/* Support for ethtool */
 	ep->mii.mdio_read = wrn_phy_read;
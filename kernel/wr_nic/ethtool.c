@@ -17,9 +17,54 @@
 #include <linux/mii.h>
 #include <linux/ethtool.h>
 #include <linux/spinlock.h>
+#include <linux/net_tstamp.h>
+#include <linux/version.h>
 
 #include "wr-nic.h"
 
+/* get_settings and set_settings are gone before 5.0: mii helpers are 4.10 */
+#undef WRN_LINK_KSETTINGS
+#if KERNEL_VERSION(4, 10, 0) <= LINUX_VERSION_CODE
+#define WRN_LINK_KSETTINGS
+#endif
+
+#ifdef WRN_LINK_KSETTINGS
+static int wrn_get_link_ksettings(struct net_device *dev,
+				  struct ethtool_link_ksettings *ks)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+
+	spin_lock_irq(&ep->lock);
+	mii_ethtool_get_link_ksettings(&ep->mii, ks);
+	spin_unlock_irq(&ep->lock);
+
+	ethtool_link_ksettings_zero_link_mode(ks, supported);
+	ethtool_link_ksettings_add_link_mode(ks, supported, FIBRE);
+	ethtool_link_ksettings_add_link_mode(ks, supported, Autoneg);
+	ethtool_link_ksettings_add_link_mode(ks, supported, 1000baseKX_Full);
+	ethtool_link_ksettings_zero_link_mode(ks, advertising);
+	ethtool_link_ksettings_add_link_mode(ks, advertising, 1000baseKX_Full);
+	ethtool_link_ksettings_add_link_mode(ks, advertising, Autoneg);
+	ks->base.port = PORT_FIBRE;
+	ks->base.speed = SPEED_1000;
+	ks->base.duplex = DUPLEX_FULL;
+	ks->base.autoneg = AUTONEG_ENABLE;
+	return 0;
+}
+
+static int wrn_set_link_ksettings(struct net_device *dev,
+				  const struct ethtool_link_ksettings *ks)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	int ret;
+
+	spin_lock_irq(&ep->lock);
+	ret = mii_ethtool_set_link_ksettings(&ep->mii, ks);
+	spin_unlock_irq(&ep->lock);
+
+	return ret;
+}
+#else
 static int wrn_get_settings(struct net_device *dev, struct ethtool_cmd *cmd)
 {
 	struct wrn_ep *ep = netdev_priv(dev);
@@ -54,6 +99,7 @@ static int wrn_set_settings(struct net_device *dev, struct ethtool_cmd *cmd)
 
 	return ret;
 }
+#endif
 
 static int wrn_nwayreset(struct net_device *dev)
 {
@@ -76,17 +122,124 @@ static void wrn_get_drvinfo(struct net_device *dev,
 		sizeof(info->bus_info));
 }
 
+/* Ring sizes are fixed in hardware: see nic-hardware.h */
+static void wrn_get_ringparam(struct net_device *dev,
+			      struct ethtool_ringparam *ring)
+{
+	ring->rx_max_pending = WRN_NR_RXDESC;
+	ring->tx_max_pending = WRN_NR_TXDESC;
+	ring->rx_pending = WRN_NR_RXDESC;
+	ring->tx_pending = WRN_NR_TXDESC;
+}
+
+/*
+ * Statistics are per nic, so all endpoints report the same values.
+ * The ptp ones are the read window of the clock (see wr-nic.h)
+ */
+struct wrn_stat {
+	char name[ETH_GSTRING_LEN];
+	int offset; /* of a u64 within struct wrn_dev */
+};
+
+#define WRN_STAT(_name, _field) \
+	{ .name = _name, .offset = offsetof(struct wrn_dev, _field) }
+
+static const struct wrn_stat wrn_stats[] = {
+	WRN_STAT("ptp_reads", ptp_stats.reads),
+	WRN_STAT("ptp_read_retries", ptp_stats.retries),
+	WRN_STAT("ptp_read_ns_last", ptp_stats.last_ns),
+	WRN_STAT("ptp_read_ns_min", ptp_stats.min_ns),
+	WRN_STAT("ptp_read_ns_max", ptp_stats.max_ns),
+	WRN_STAT("tx_stamps", tstamp_stats.stamps),
+	WRN_STAT("tx_stamp_unmatched", tstamp_stats.unmatched),
+	WRN_STAT("tx_stamp_timeouts", tstamp_stats.timeouts),
+	WRN_STAT("tx_stamp_discarded", tstamp_stats.discarded),
+	WRN_STAT("tx_stamp_irqs", tstamp_stats.irqs),
+	WRN_STAT("tx_stamp_fifo_entries", tstamp_stats.fifo_entries),
+	WRN_STAT("tx_stamp_fifo_max", tstamp_stats.fifo_max),
+	WRN_STAT("tx_stamp_fifo_full", tstamp_stats.fifo_full),
+	WRN_STAT("rx_stamp_time_reads", tstamp_stats.rx_ppsg_reads),
+};
+
+static int wrn_get_sset_count(struct net_device *dev, int sset)
+{
+	if (sset != ETH_SS_STATS)
+		return -EOPNOTSUPP;
+	return ARRAY_SIZE(wrn_stats);
+}
+
+static void wrn_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	int i;
+
+	if (sset != ETH_SS_STATS)
+		return;
+	for (i = 0; i < ARRAY_SIZE(wrn_stats); i++)
+		memcpy(data + i * ETH_GSTRING_LEN, wrn_stats[i].name,
+		       ETH_GSTRING_LEN);
+}
+
+static void wrn_get_ethtool_stats(struct net_device *dev,
+				  struct ethtool_stats *stats, u64 *data)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+	void *base = ep->wrn;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(wrn_stats); i++)
+		data[i] = *(u64 *)(base + wrn_stats[i].offset);
+}
+
+static int wrn_get_ts_info(struct net_device *dev,
+			   struct ethtool_ts_info *info)
+{
+	struct wrn_ep *ep = netdev_priv(dev);
+
+	info->so_timestamping =
+		SOF_TIMESTAMPING_TX_HARDWARE |
+		SOF_TIMESTAMPING_RX_HARDWARE |
+		SOF_TIMESTAMPING_RAW_HARDWARE |
+		SOF_TIMESTAMPING_TX_SOFTWARE |
+		SOF_TIMESTAMPING_RX_SOFTWARE |
+		SOF_TIMESTAMPING_SOFTWARE;
+	info->phc_index = wrn_ptp_index(ep->wrn); /* -1 if not registered */
+	info->tx_types = (1 << HWTSTAMP_TX_OFF) | (1 << HWTSTAMP_TX_ON);
+	/* Same as wrn_rx_filter_grant() in timestamp.c */
+	info->rx_filters =
+		(1 << HWTSTAMP_FILTER_NONE) |
+		(1 << HWTSTAMP_FILTER_ALL) |
+		(1 << HWTSTAMP_FILTER_PTP_V2_L4_EVENT) |
+		(1 << HWTSTAMP_FILTER_PTP_V2_L4_SYNC) |
+		(1 << HWTSTAMP_FILTER_PTP_V2_L4_DELAY_REQ) |
+		(1 << HWTSTAMP_FILTER_PTP_V2_L2_EVENT) |
+		(1 << HWTSTAMP_FILTER_PTP_V2_L2_SYNC) |
+		(1 << HWTSTAMP_FILTER_PTP_V2_L2_DELAY_REQ) |
+		(1 << HWTSTAMP_FILTER_PTP_V2_EVENT) |
+		(1 << HWTSTAMP_FILTER_PTP_V2_SYNC) |
+		(1 << HWTSTAMP_FILTER_PTP_V2_DELAY_REQ);
+	return 0;
+}
+
 /*
  * These are the operations we support. No coalescing is there since
  * most of the traffic will just happen within the FPGA switching core.
- * Similarly, other funcionality like ringparam are not used.
  * get_eeprom/set_eeprom may be useful for a simple MAC address management.
  */
 static const struct ethtool_ops wrn_ethtool_ops = {
+#ifdef WRN_LINK_KSETTINGS
+	.get_link_ksettings = wrn_get_link_ksettings,
+	.set_link_ksettings = wrn_set_link_ksettings,
+#else
 	.get_settings	= wrn_get_settings,
 	.set_settings	= wrn_set_settings,
+#endif
 	.get_drvinfo	= wrn_get_drvinfo,
 	.nway_reset	= wrn_nwayreset,
+	.get_ringparam	= wrn_get_ringparam,
+	.get_sset_count	= wrn_get_sset_count,
+	.get_strings	= wrn_get_strings,
+	.get_ethtool_stats = wrn_get_ethtool_stats,
+	.get_ts_info	= wrn_get_ts_info,
 	/* Some of the default methods apply for us */
 	.get_link	= ethtool_op_get_link,
 	/* FIXME: get_regs_len and get_regs may be useful for debugging */
@@ -12,9 +12,11 @@
  */
 
 #include <linux/kernel.h>
+#include <linux/mm.h>
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
 #include <linux/errno.h>
+#include <linux/delay.h>
 #include <linux/spinlock.h>
 #include <linux/net_tstamp.h>
 #include <linux/version.h>
@@ -55,6 +57,15 @@
 #define record_last_rx(dev)	((dev)->last_rx = jiffies)
 #endif
 
+#undef WRN_NAPI_COMPLETE_DONE
+#if KERNEL_VERSION(3, 19, 0) <= LINUX_VERSION_CODE
+#define WRN_NAPI_COMPLETE_DONE
+#endif
+
+#ifndef WRN_NAPI_COMPLETE_DONE
+#define napi_complete_done(napi, work)	napi_complete(napi)
+#endif
+
 
 /*
  * The following functions are the standard network device operations.
@@ -76,7 +87,7 @@ static int wrn_open(struct net_device *dev)
 	clear_bit(WRN_EP_UP, &ep->ep_flags);
 	wrn_ep_open(dev);
 
-	/* Software-only management is in this file*/
+	/* Software-only management is in this file (bql: see wrn_close) */
 	if (netif_queue_stopped(dev))
 		netif_wake_queue(dev);
 	else
@@ -95,17 +106,43 @@ static int wrn_open(struct net_device *dev)
 	return 0;
 }
 
+/*
+ * The napi poll belongs to the card, so it completes the frames of a
+ * closed port too, and reports them to byte queue limits. Wait for
+ * them: the ring is shared, but we have one endpoint (wrn_start_xmit)
+ */
+static int wrn_tx_drain(struct wrn_dev *wrn)
+{
+	unsigned long j = jiffies + WRN_TX_DRAIN_TIMEOUT;
+
+	while (atomic_read(&wrn->tx_count)) {
+		if (time_after(jiffies, j))
+			return -ETIMEDOUT;
+		msleep(1);
+	}
+	return 0;
+}
+
 static int wrn_close(struct net_device *dev)
 {
 	struct wrn_ep *ep = netdev_priv(dev);
 	int ret;
 
+	/* No more xmit, then wait for what is in flight */
+	netif_tx_disable(dev);
+	if (wrn_tx_drain(ep->wrn) == 0) {
+		/* Nothing outstanding: the next open starts from scratch */
+		netdev_reset_queue(dev);
+	} else {
+		/* Completions will come later, and match what was sent */
+		netdev_warn(dev, "tx frames still pending at close\n");
+	}
+
 	ret = wrn_ep_close(dev);
 	if (ret)
 		return ret;
 
 	/* FIXME: software-only fixing at close time */
-	netif_stop_queue(dev);
 	netif_carrier_off(dev);
 	clear_bit(WRN_EP_UP, &ep->ep_flags);
 	return 0;
@@ -134,13 +171,18 @@ static int wrn_set_mac_address(struct net_device *dev, void *vaddr)
 	return 0;
 }
 
-/* Next descriptor */
-static int __wrn_next_desc(int i)
+/* Next descriptor, for either ring */
+static int __wrn_next_txdesc(int i)
 {
-	return (i+1) % WRN_NR_DESC;
+	return (i+1) % WRN_NR_TXDESC;
 }
 
-/* This is called with the lock taken */
+static int __wrn_next_rxdesc(int i)
+{
+	return (i+1) % WRN_NR_RXDESC;
+}
+
+/* Only called by xmit, the single producer: see struct wrn_dev */
 static int __wrn_alloc_tx_desc(struct wrn_dev *wrn)
 {
 	int ret = wrn->next_tx_head;
@@ -148,31 +190,33 @@ static int __wrn_alloc_tx_desc(struct wrn_dev *wrn)
 
 	tx = wrn->txd + ret;
 
-	/* Check if it's available */
-	if (readl(&tx->tx1) & NIC_TX1_D1_READY) {
+	/* Check if it's available: the queue is stopped when full */
+	if (atomic_read(&wrn->tx_count) == WRN_NR_TXDESC
+	    || (readl(&tx->tx1) & NIC_TX1_D1_READY)) {
 		pr_debug("%s: not free %i\n", __func__, ret);
 		return -ENOMEM;
 	}
-	wrn->next_tx_head = __wrn_next_desc(ret);
 	return ret;
 }
 
 /* Actual transmission over a single endpoint */
+static void __wrn_tx_data(struct wrn_ep *ep, int desc, void *data, int len)
+{
+	struct wrn_dev *wrn = ep->wrn;
+	u32 __iomem *ptr = __wrn_desc_mem(wrn, WRN_DDIR_TX, desc);
+
+	pr_debug("%s: %i -- data %p, len %i -- desc %i\n", __func__, __LINE__,
+		 data, len, desc);
+	__wrn_copy_out(ptr, data, len);
+}
+
 static void __wrn_tx_desc(struct wrn_ep *ep, int desc,
-			  void *data, int len, int id, int do_stamp)
+			  int len, int id, int do_stamp)
 {
 	struct wrn_dev *wrn = ep->wrn;
 	int offset = __wrn_desc_offset(wrn, WRN_DDIR_TX, desc);
-	u32 *ptr = __wrn_desc_mem(wrn, WRN_DDIR_TX, desc);
 	struct wrn_txd __iomem *tx = wrn->txd + desc;
 
-	/* data */
-	pr_debug("%s: %i -- data %p, len %i ", __func__, __LINE__,
-	       data, len);
-	pr_debug("-- desc %i (tx %p)\n", desc, tx);
-
-	__wrn_copy_out(ptr, data, len);
-
 	/* TX register 3: mask of endpoints (FIXME: broadcast) */
 	//printk("EP Num: %d\n", ep->ep_number);
 
@@ -193,60 +237,101 @@ static int wrn_start_xmit(struct sk_buff *skb, struct net_device *dev)
 	struct wrn_ep *ep = netdev_priv(dev);
 	struct wrn_dev *wrn = ep->wrn;
 	struct skb_shared_info *info = skb_shinfo(skb);
-	//unsigned long flags;
+	struct wrn_desc_pending *d;
+	struct sk_buff *old;
 	int desc;
 	int id;
 	int do_stamp = 0;
-	void *data; /* FIXME: move data and len to __wrn_tx_desc */
+	void *data;
 	unsigned int len;
 
 	if (unlikely(skb->len > WRN_MTU)) {
 		/* FIXME: check this WRN_MTU is needed and used properly */
 		ep->stats.tx_errors++;
-		return -EMSGSIZE;
+		dev_kfree_skb_any(skb);
+		return NETDEV_TX_OK;
 	}
 
-	/* Allocate a descriptor and id (start from last allocated) */
-	//spin_lock_irqsave(&wrn->lock, flags);
+	/*
+	 * Allocate a descriptor and id (start from last allocated). No
+	 * lock: we are the only producer, and the consumer only reads a
+	 * slot after it is published by tx_count and fired.
+	 */
+	BUILD_BUG_ON(WRN_NR_ENDPOINTS != 1); /* or xmit needs a lock */
 	desc = __wrn_alloc_tx_desc(wrn);
-	id = (wrn->id++) & 0xffff;
-	if (id == 0)
-		id = wrn->id++; /* 0 cannot be used in the SPEC */
-
-	//spin_unlock_irqrestore(&wrn->lock, flags);
-
-	if (desc < 0) /* error */
-		return desc;
+	if (desc < 0) {
+		/* Not expected, as we stop the queue when the ring is full */
+		netif_stop_queue(dev);
+		return NETDEV_TX_BUSY;
+	}
+	/* The descriptor is in the low bits of the id (see wr-nic.h) */
+	BUILD_BUG_ON(WRN_NR_TXDESC > (1 << WRN_FID_DESC_BITS));
+	id = ((wrn->id++ << WRN_FID_DESC_BITS) | desc) & 0xffff;
+	if (id == 0) /* 0 cannot be used in the SPEC */
+		id = ((wrn->id++ << WRN_FID_DESC_BITS) | desc) & 0xffff;
 
 	data = skb->data;
 	len = skb->len;
 
-	//spin_lock_irqsave(&ep->lock, flags);
-
-	if (wrn->skb_desc[desc].skb) {
-		/* The timestamp has not been collected: silently discard it */
+	/* Stamp if the socket asks and SIOCSHWTSTAMP enabled tx stamps */
+	if ((info->tx_flags & SKBTX_HW_TSTAMP)
+	    && test_bit(WRN_EP_STAMPING_TX, &ep->ep_flags)) {
+		info->tx_flags |= SKBTX_IN_PROGRESS;
+		do_stamp = 1;
 	}
-	wrn->skb_desc[desc].skb = skb; /* Save for tx irq and stamping */
-	wrn->skb_desc[desc].frame_id = id; /* Save for tx irq and stamping */
 
-	//netif_stop_queue(dev); /* Queue stopped until tx is over (FIXME?) */
+	/* Copy first: once published, the skb may be released by others */
+	__wrn_tx_data(ep, desc, data, len);
+	skb_tx_timestamp(skb);
 
-	/* FIXME: check the WRN_EP_STAMPING_TX flag and its meaning */
-	if (info->tx_flags & SKBTX_HW_TSTAMP) {
-		/* hardware timestamping is enabled */
-		do_stamp = 1;
+	d = wrn->skb_desc + desc;
+	/* The timestamp has not been collected, nor timed out: release */
+	old = xchg(&d->skb, NULL);
+	if (old) {
+		wrn->tstamp_stats.discarded++;
+		dev_kfree_skb_any(old);
+	}
+	d->valid = 0;
+	d->frame_id = id; /* Save for tx irq and stamping */
+	d->port_id = ep->ep_number; /* Save for byte queue limits */
+	d->len = len;
+	d->fired = 0;
+	d->stamp = do_stamp;
+	d->stamp_deadline = jiffies + WRN_TSTAMP_TIMEOUT;
+	smp_wmb(); /* the timestamp irq looks for frame_id once skb is set */
+	d->skb = skb; /* Save for tx irq and stamping */
+
+	/* Publish the slot before firing, so completion can't be missed */
+	smp_wmb();
+	atomic_inc(&wrn->tx_count);
+	wrn->next_tx_head = __wrn_next_txdesc(desc);
+
+	/* Account before firing, as the poll may complete it at once */
+	netdev_sent_queue(dev, len);
+
+	/* This fires tx, the data is already in the descriptor */
+	__wrn_tx_desc(ep, desc, len, id, do_stamp);
+	wmb(); /* the poll checks "fired" before the hardware flag */
+	d->fired = 1;
+
+	/* Release the frame later, if its timestamp doesn't come */
+	if (do_stamp && !timer_pending(&wrn->tstamp_timer))
+		mod_timer(&wrn->tstamp_timer, d->stamp_deadline);
+
+	/* If this was the last free descriptor, wait for tx-complete */
+	if (atomic_read(&wrn->tx_count) == WRN_NR_TXDESC) {
+		netif_stop_queue(dev);
+		smp_mb(); /* against the wake in wrn_tx_complete() */
+		if (atomic_read(&wrn->tx_count) < WRN_NR_TXDESC)
+			netif_start_queue(dev);
 	}
-
-	/* This both copies the data to the descriptr and fires tx */
-	__wrn_tx_desc(ep, desc, data, len, id, do_stamp);
 
 	/* We are done, this is trivial maiintainance*/
 	ep->stats.tx_packets++;
 	ep->stats.tx_bytes += len;
 	trans_update(dev);
 
-	//spin_unlock_irqrestore(&ep->lock, flags);
-	return 0;
+	return NETDEV_TX_OK;
 }
 
 struct net_device_stats *wrn_get_stats(struct net_device *dev)
@@ -349,23 +434,78 @@ int wrn_netops_init(struct net_device *dev)
 	return 0;
 }
 
+/*
+ * Rx buffers come from a per-nic pool, only used by the napi poll (or
+ * while it is disabled), so no locking is needed. Allocation happens at
+ * the end of each poll, not for each frame
+ */
+void wrn_rx_pool_fill(struct wrn_dev *wrn)
+{
+	void *buf;
+
+	while (wrn->rx_pool_count < WRN_RX_POOL_SIZE) {
+		buf = netdev_alloc_frag(WRN_RX_BUFSIZE);
+		if (!buf)
+			break; /* retry next time */
+		wrn->rx_pool[wrn->rx_pool_count++] = buf;
+	}
+}
+
+void wrn_rx_pool_free(struct wrn_dev *wrn)
+{
+	while (wrn->rx_pool_count)
+		put_page(virt_to_head_page(wrn->rx_pool[--wrn->rx_pool_count]));
+}
+
+static inline void *wrn_rx_buf_get(struct wrn_dev *wrn)
+{
+	if (unlikely(!wrn->rx_pool_count))
+		return NULL;
+	return wrn->rx_pool[--wrn->rx_pool_count];
+}
+
 /*
  * From this onwards, it's all about interrupt management
  */
-static void __wrn_rx_descriptor(struct wrn_dev *wrn, int desc)
+/*
+ * The seconds of rx stamps come from a snapshot of the pps generator,
+ * taken at most once per poll. Frames are older than the snapshot, so
+ * the ones with a higher counter belong to the previous second. A frame
+ * may be newer, though, if it came during the poll: then, and near the
+ * end of a second, the snapshot is taken again. A long poll (or one
+ * that was interrupted) may see frames that came more than one second
+ * after the snapshot, so it is also taken again once it gets old.
+ */
+static ktime_t wrn_rx_stamp(struct wrn_dev *wrn, struct wrn_ppsg_snap *snap,
+			    u32 ts_r)
+{
+	ktime_t now = ktime_get();
+
+	if (!snap->valid || snap->cycles < ts_r
+	    || snap->cycles > REFCLK_FREQ - WRN_PPSG_SNAP_GUARD
+	    || ktime_to_ns(ktime_sub(now, snap->taken))
+	       > WRN_PPSG_SNAP_AGE_NS) {
+		wrn_ppsg_get_time(wrn, &snap->sec, &snap->cycles,
+				  NULL, NULL, NULL);
+		snap->taken = now;
+		snap->valid = 1;
+		wrn->tstamp_stats.rx_ppsg_reads++;
+	}
+	return wrn_stamp_to_ktime(snap->sec, snap->cycles, ts_r);
+}
+
+static void __wrn_rx_descriptor(struct wrn_dev *wrn, int desc,
+				struct wrn_ppsg_snap *snap)
 {
 	struct net_device *dev;
 	struct wrn_ep *ep;
 	struct sk_buff *skb;
+	void *buf;
 	struct wrn_rxd __iomem *rx;
 	u32 r1, r2, r3, offset;
 	int epnum, off, len;
-	u32 ts_r, ts_f;
+	u32 ts_r;
 	struct skb_shared_hwtstamps *hwts;
-	struct timespec ts;
-	u32 counter_ppsg; /* PPS generator nanosecond counter */
-	u32 utc;
-	s32 cntr_diff;
 
 	rx = wrn->rxd + desc;
 	r1 = readl(&rx->rx1);
@@ -393,7 +533,6 @@ static void __wrn_rx_descriptor(struct wrn_dev *wrn, int desc)
 
 	epnum = NIC_RX1_D1_PORT_R(r1);
 	ts_r = NIC_RX1_D2_TS_R_R(r2);
-	ts_f = NIC_RX1_D2_TS_F_R(r2);
 
 	dev = wrn->dev[epnum];
 	ep = netdev_priv(dev);
@@ -401,43 +540,37 @@ static void __wrn_rx_descriptor(struct wrn_dev *wrn, int desc)
 	/* Data and length */
 	off = NIC_RX1_D3_OFFSET_R(r3);
 	len = NIC_RX1_D3_LEN_R(r3);
-	skb = netdev_alloc_skb(dev, len + 16 /* FIXME: real size for rx */);
-	/* FIXME: handle allocation failure */
-	skb_reserve(skb, 2);
-	__wrn_copy_in(skb_put(skb, len), wrn->databuf + off, len);
+	if (unlikely(len > WRN_MTU)) {
+		ep->stats.rx_length_errors++;
+		goto release;
+	}
+	buf = wrn_rx_buf_get(wrn);
+	if (unlikely(!buf))
+		goto drop; /* the pool is refilled at the end of the poll */
+	__wrn_copy_in(buf + WRN_RX_HEADROOM, wrn->databuf + off, len);
 
 	/* Rewrite lenght (modified during rx) and mark it free ASAP */
 	writel((2000 << 16) | offset, &rx->rx3);
 	writel(NIC_RX1_D1_EMPTY, &rx->rx1);
 
-	/* RX timestamping part */
-
-	wrn_ppsg_read_time(wrn, &counter_ppsg, &utc);
-
-	if (counter_ppsg < ts_r)
-		utc--;
-
-	ts.tv_sec = (s32)utc & 0x7fffffff;
-	cntr_diff = (ts_r & 0xf) - ts_f;
-	/* the bit says the rising edge cnter is 1tick ahead */
-	if (cntr_diff == 1 || cntr_diff == (-0xf))
-		ts.tv_sec |= 0x80000000;
-	ts.tv_nsec = ts_r * NSEC_PER_TICK;
-
-	pr_debug("Timestamp: %li:%li, ahead = %d\n",
-		 ts.tv_sec & 0x7fffffff,
-		 ts.tv_nsec & 0x7fffffff,
-		 ts.tv_sec & 0x80000000 ? 1 : 0);
-
-	if (1) {
-		/* SPEC: don't do the strange stuff for wr-ptp */
-		ts.tv_sec &= ~0x80000000;
-		ts.tv_nsec &= 0x7fffffff;
+	skb = build_skb(buf, WRN_RX_BUFSIZE);
+	if (unlikely(!skb)) {
+		put_page(virt_to_head_page(buf));
+		ep->stats.rx_dropped++;
+		return;
 	}
+	skb_reserve(skb, WRN_RX_HEADROOM);
+	skb_put(skb, len);
 
-	if (!(r1 & NIC_RX1_D1_TS_INCORRECT)) {
+	/*
+	 * RX timestamping part. The falling-edge counter (TS_F) would
+	 * tell whether the rising edge one is one tick ahead, but wr-ptp
+	 * doesn't use this on the SPEC, so we ignore it. Only frames
+	 * accepted by the rx filter pay for the conversion.
+	 */
+	if (!(r1 & NIC_RX1_D1_TS_INCORRECT) && wrn_rx_filter(ep, skb)) {
 		hwts = skb_hwtstamps(skb);
-		hwts->hwtstamp = timespec_to_ktime(ts);
+		hwts->hwtstamp = wrn_rx_stamp(wrn, snap, ts_r);
 	}
 
 	skb->protocol = eth_type_trans(skb, dev);
@@ -445,7 +578,15 @@ static void __wrn_rx_descriptor(struct wrn_dev *wrn, int desc)
 	record_last_rx(dev);
 	ep->stats.rx_packets++;
 	ep->stats.rx_bytes += len;
-	netif_receive_skb(skb);
+	/* Even with gro off, recent kernels batch these up to the poll end */
+	napi_gro_receive(&wrn->napi, skb);
+	return;
+
+drop: /* We know the endpoint, but have no buffer for the frame */
+	ep->stats.rx_dropped++;
+release: /* The caller already accounted the frame: just free the desc */
+	writel((2000 << 16) | offset, &rx->rx3);
+	writel(NIC_RX1_D1_EMPTY, &rx->rx1);
 	return;
 
 err_out: /* Mark it free anyways -- with its full length */
@@ -459,63 +600,108 @@ err_out: /* Mark it free anyways -- with its full length */
 
 }
 
-/* This function is called in soft-irq context */
-void wrn_rx_interrupt(unsigned long arg)
-{
-	int desc;
-	struct wrn_dev *wrn = (void *)arg;
-	struct wrn_rxd __iomem *rx;
-	u32 reg;
-
-	while (1) {
-		desc = wrn->next_rx;
-		rx = wrn->rxd + desc;
-		reg = readl(&rx->rx1);
-		if (reg & NIC_RX1_D1_EMPTY)
-			break;
-		__wrn_rx_descriptor(wrn, desc);
-		wrn->next_rx = __wrn_next_desc(desc);
-	}
-	writel(NIC_EIC_IER_RCOMP, (void *)wrn->regs + 0x24 /* IER */);
-}
-
-/* This, lazily, remains in hard-irq context */
-static void wrn_tx_interrupt(struct wrn_dev *wrn)
+/*
+ * Tx completion, called by the napi poll: the single consumer of the
+ * ring (see struct wrn_dev). Slots are published by xmit before it
+ * fires them, so a slot not yet marked as fired is retried by polling
+ * again. Returns the number of descriptors completed, or the budget
+ * if the poll must be repeated.
+ */
+static int wrn_tx_complete(struct wrn_dev *wrn, int budget)
 {
 	struct wrn_txd *tx;
 	struct sk_buff *skb;
-	struct skb_shared_info *info;
-
+	struct wrn_desc_pending *d;
+	struct net_device *dev;
+	unsigned int pkts[WRN_NR_ENDPOINTS] = {0,};
+	unsigned int bytes[WRN_NR_ENDPOINTS] = {0,};
 	u32 reg;
-	int i;
+	int i, done = 0, again = 0;
 
 	/* Loop using our tail until one is not sent */
-	while ((i = wrn->next_tx_tail) != wrn->next_tx_head) {
+	while (done < budget && atomic_read(&wrn->tx_count)) {
+		smp_rmb(); /* read the slot after it is published */
+		i = wrn->next_tx_tail;
+		d = wrn->skb_desc + i;
+		if (!d->fired) {
+			again = 1; /* xmit is firing it right now */
+			break;
+		}
+		rmb();
 		/* Check if this is txdone */
 		tx = wrn->txd + i;
 		reg = readl(&tx->tx1);
 		if (reg & NIC_TX1_D1_READY)
-			return; /* no more */
+			break; /* no more */
 
-		skb = wrn->skb_desc[i].skb;
-		if (!skb) {
-			pr_err("no socket in descriptor %i\n", i);
-			return;
-		}
-		info = skb_shinfo(skb);
+		pkts[d->port_id]++;
+		bytes[d->port_id] += d->len;
 
-		if (info->tx_flags & SKBTX_HW_TSTAMP) {
-			/* hardware timestamping is enabled */
-			info->tx_flags |= SKBTX_IN_PROGRESS;
-			pr_debug("%s: %i -- in progress\n", __func__, __LINE__);
+		/*
+		 * The skb may be already released by the timestamp irq,
+		 * so only touch it once we own it; d->stamp is ours.
+		 */
+		skb = d->skb;
+		if (skb && d->stamp) {
 			wrn_tx_tstamp_skb(wrn, i);
-			/* It has been freed if found; otherwise keep it */
-		} else {
-			dev_kfree_skb_irq(skb);
-			wrn->skb_desc[i].skb = 0;
+			/* It has been freed if found; otherwise keep */
+		} else if (skb && cmpxchg(&d->skb, skb, NULL) == skb) {
+			dev_kfree_skb_any(skb);
 		}
-		wrn->next_tx_tail = __wrn_next_desc(i);
+		wrn->next_tx_tail = __wrn_next_txdesc(i);
+		smp_mb(); /* we are done with the slot: release it to xmit */
+		atomic_dec(&wrn->tx_count);
+		done++;
+	}
+
+	/* Report to byte queue limits, and restart who found the ring full */
+	for (i = 0; i < WRN_NR_ENDPOINTS; i++) {
+		dev = wrn->dev[i];
+		if (!dev)
+			continue;
+		if (pkts[i])
+			netdev_completed_queue(dev, pkts[i], bytes[i]);
+		smp_mb(); /* against the stop in wrn_start_xmit() */
+		if (netif_queue_stopped(dev) && netif_running(dev)
+		    && atomic_read(&wrn->tx_count) < WRN_NR_TXDESC)
+			netif_wake_queue(dev);
+	}
+	return again ? budget : done;
+}
+
+/*
+ * Napi poll: complete tx and process up to "budget" rx frames, in
+ * soft-irq context. The rx-complete and tx-complete interrupts are
+ * only re-enabled once both rings are drained
+ */
+int wrn_poll(struct napi_struct *napi, int budget)
+{
+	struct wrn_dev *wrn = container_of(napi, struct wrn_dev, napi);
+	struct wrn_rxd __iomem *rx;
+	struct wrn_ppsg_snap snap = {0,};
+	int desc, tx_done, work_done = 0;
+	u32 reg;
+
+	tx_done = wrn_tx_complete(wrn, WRN_TX_BUDGET);
+
+	while (work_done < budget) {
+		desc = wrn->next_rx;
+		rx = wrn->rxd + desc;
+		reg = readl(&rx->rx1);
+		if (reg & NIC_RX1_D1_EMPTY)
+			break;
+		__wrn_rx_descriptor(wrn, desc, &snap);
+		wrn->next_rx = __wrn_next_rxdesc(desc);
+		work_done++;
 	}
+	wrn_rx_pool_fill(wrn);
+	if (work_done == budget || tx_done == WRN_TX_BUDGET)
+		return budget; /* poll again */
+
+	napi_complete_done(napi, work_done);
+	writel(NIC_EIC_IER_RCOMP | NIC_EIC_IER_TCOMP,
+	       (void *)wrn->regs + 0x24 /* IER */);
+	return work_done;
 }
 
 irqreturn_t wrn_interrupt(int irq, void *dev_id)
@@ -533,19 +719,21 @@ irqreturn_t wrn_interrupt(int irq, void *dev_id)
 	}
 	if (irqs & NIC_EIC_ISR_TCOMP) {
 		pr_debug("%s: TX complete\n", __func__);
-		wrn_tx_interrupt(wrn);
-		writel(NIC_EIC_ISR_TCOMP, (void *)regs + 0x2c);
+		/* Like rx below, completion is done by the napi poll */
+		writel(NIC_EIC_ISR_TCOMP, (void *)regs + 0x2c /* ISR */);
+		writel(NIC_EIC_IDR_TCOMP, (void *)regs + 0x20 /* IDR */);
+		napi_schedule(&wrn->napi);
 	}
 	if (irqs & NIC_EIC_ISR_RCOMP) {
 		pr_debug("%s: RX complete\n", __func__);
 		/*
 		 * This must be processed in soft-irq context, as this is
 		 * what is needed for socket processing. So disable
-		 * the interrupt first, then run the tasklet
+		 * the interrupt first, then schedule the napi poll
 		 */
 		writel(NIC_EIC_ISR_RCOMP, (void *)wrn->regs + 0x2c /* ISR */);
 		writel(NIC_EIC_IDR_RCOMP, (void *)wrn->regs + 0x20 /* IDR */);
-		tasklet_schedule(&wrn->rx_tlet);
+		napi_schedule(&wrn->napi);
 	}
 	return IRQ_HANDLED;
 }
@@ -82,10 +82,15 @@ enum fpga_blocks {
 /* In addition to the above enumeration, we scan for those many endpoints */
 #define WRN_NR_ENDPOINTS		1
 
-/* 8 tx and 8 rx descriptors */
+/*
+ * 8 tx and 8 rx descriptors: they are fixed in the descriptor memory of
+ * the NIC (0x80 and 0x100 in its registers), and the NIC walks all of
+ * them. Each frame uses a 2kB slot in the 32kB buffer memory.
+ */
 #define WRN_NR_DESC	8
 #define WRN_NR_TXDESC	WRN_NR_DESC
 #define WRN_NR_RXDESC	WRN_NR_DESC
+#define WRN_DESC_SIZE	0x800
 
 /* Magic number for endpoint (missing, I fear) */
 #define WRN_EP_MAGIC 0xcafebabe
@@ -17,12 +17,12 @@ enum wrn_ddir {
     WRN_DDIR_TX
 };
 
-/* We place the descriptor memory in fixed positions (2kB each) */
+/* We place the descriptor memory in fixed slots: tx first, then rx */
 static inline int __wrn_desc_offset(struct wrn_dev *wrn,
 				    enum wrn_ddir dir, int nr)
 {
 	if (dir == WRN_DDIR_RX) nr += WRN_NR_TXDESC;
-	return 0x800 * nr;
+	return WRN_DESC_SIZE * nr;
 }
 
 static inline u32 __iomem *__wrn_desc_mem(struct wrn_dev *wrn,
@@ -33,32 +33,76 @@ static inline u32 __iomem *__wrn_desc_mem(struct wrn_dev *wrn,
 	return ptr + __wrn_desc_offset(wrn, dir, nr);
 }
 
-/* The two copy functions take arguments in the same order as memcpy */
+/*
+ * The two copy functions take arguments in the same order as memcpy.
+ * Data in descriptors is offset by WRN_DDATA_OFFSET, so the copy starts
+ * that much earlier in the skb and moves whole words. The skb side is
+ * usually aligned (as the IP header is), so we have a fast path with
+ * raw accesses, and fall back to the unaligned word loop only when
+ * needed. Raw accesses preserve the byte order, like the le32 accessors
+ * used with writel/readl do.
+ *
+ * 64-bit accesses through the GN4124 bridge have not been checked on
+ * hardware yet, so they are only used if WRN_MMIO64 is defined (e.g.
+ * "make WR_NIC_CFLAGS=-DWRN_MMIO64"); tools/wr-nic-copybench measures
+ * both paths on a card.
+ */
 static inline void __wrn_copy_out(u32 __iomem *to, void *from, int size)
 {
-	u32 i;
+	int nw;
 
 	from -= WRN_DDATA_OFFSET;
 	size += WRN_DDATA_OFFSET;
-	while (size > 0) {
-		i = get_unaligned_le32(from);
-		writel(i, to);
-		to++; from += sizeof(i);
-		size -= sizeof(i);
+	nw = DIV_ROUND_UP(size, sizeof(u32));
+
+#if defined(CONFIG_64BIT) && defined(WRN_MMIO64)
+	if (IS_ALIGNED((unsigned long)from, sizeof(u64))) {
+		u64 __iomem *to64 = (u64 __iomem *)to;
+		u64 *from64 = from;
+
+		for (; nw >= 2; nw -= 2)
+			__raw_writeq(*from64++, to64++);
+		to = (u32 __iomem *)to64;
+		from = from64;
+	}
+#endif
+	if (IS_ALIGNED((unsigned long)from, sizeof(u32))) {
+		u32 *from32 = from;
+
+		while (nw--)
+			__raw_writel(*from32++, to++);
+		return;
 	}
+	for (; nw; nw--, from += sizeof(u32))
+		__raw_writel(get_unaligned((u32 *)from), to++);
 }
 
 static inline void __wrn_copy_in(void *to, u32 __iomem *from, int size)
 {
-	u32 i;
+	int nw;
 
 	to -= WRN_DDATA_OFFSET;
 	size += WRN_DDATA_OFFSET;
-	while (size > 0) {
-		i = readl(from);
-		put_unaligned_le32(i, to);
-		to += sizeof(i); from++;
-		size -= sizeof(i);
+	nw = DIV_ROUND_UP(size, sizeof(u32));
+
+#if defined(CONFIG_64BIT) && defined(WRN_MMIO64)
+	if (IS_ALIGNED((unsigned long)to, sizeof(u64))) {
+		u64 __iomem *from64 = (u64 __iomem *)from;
+		u64 *to64 = to;
+
+		for (; nw >= 2; nw -= 2)
+			*to64++ = __raw_readq(from64++);
+		from = (u32 __iomem *)from64;
+		to = to64;
 	}
-}
+#endif
+	if (IS_ALIGNED((unsigned long)to, sizeof(u32))) {
+		u32 *to32 = to;
 
+		while (nw--)
+			*to32++ = __raw_readl(from++);
+		return;
+	}
+	for (; nw; nw--, to += sizeof(u32))
+		put_unaligned(__raw_readl(from++), (u32 *)to);
+}
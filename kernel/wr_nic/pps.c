@@ -9,23 +9,102 @@
  * published by the Free Software Foundation.
  */
 #include <linux/kernel.h>
+#include <linux/jiffies.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
 #include <linux/netdevice.h>
 #include <linux/sockios.h>
 #include <linux/net_tstamp.h>
+#include <linux/version.h>
 
 #include "wr-nic.h"
 
-void wrn_ppsg_read_time(struct wrn_dev *wrn, u32 *fine_counter, u32 *utc)
+/* PTP_SYS_OFFSET_EXTENDED and its helpers appeared in 5.0 */
+#if KERNEL_VERSION(5, 0, 0) <= LINUX_VERSION_CODE
+#define wrn_ppsg_prets(sts)	ptp_read_system_prets(sts)
+#define wrn_ppsg_postts(sts)	ptp_read_system_postts(sts)
+#else
+#define wrn_ppsg_prets(sts)	do {} while (0)
+#define wrn_ppsg_postts(sts)	do {} while (0)
+#endif
+
+/*
+ * The following functions act on the full time (40-bit seconds and
+ * the counter of 8ns cycles), for timestamps and the ptp clock. The
+ * nsec counter is read between two reads of the seconds, and again if
+ * they differ.
+ * If requested, system time is sampled right before and after reading
+ * the nsec counter, as ktime and for the ptp "sts" (which may be NULL).
+ * Returns the number of retries.
+ */
+int wrn_ppsg_get_time(struct wrn_dev *wrn, u64 *sec, u32 *cycles,
+		      ktime_t *pre, ktime_t *post,
+		      struct ptp_system_timestamp *sts)
+{
+	struct PPSG_WB __iomem *regs = wrn->ppsg_regs;
+	u32 lo1, lo2, hi, cnt;
+	int retries = -1;
+
+	do {
+		retries++;
+		lo1 = readl(&regs->CNTR_UTCLO);
+		hi = readl(&regs->CNTR_UTCHI);
+		if (pre)
+			*pre = ktime_get_real();
+		wrn_ppsg_prets(sts);
+		cnt = readl(&regs->CNTR_NSEC);
+		wrn_ppsg_postts(sts);
+		if (post)
+			*post = ktime_get_real();
+		lo2 = readl(&regs->CNTR_UTCLO);
+	} while (lo2 != lo1);
+
+	*sec = ((u64)(hi & 0xff) << 32) | lo2;
+	*cycles = cnt;
+	return retries;
+}
+
+void wrn_ppsg_set_time(struct wrn_dev *wrn, u64 sec, u32 cycles)
 {
-	u32 utc1, utc2, cnt;
+	struct PPSG_WB __iomem *regs = wrn->ppsg_regs;
+	u32 cr;
 
-	utc1 = readl(&wrn->ppsg_regs->CNTR_UTCLO);
-	cnt = readl(&wrn->ppsg_regs->CNTR_NSEC);
-	utc2 = readl(&wrn->ppsg_regs->CNTR_UTCLO);
+	writel((u32)sec, &regs->ADJ_UTCLO);
+	writel((sec >> 32) & 0xff, &regs->ADJ_UTCHI);
+	writel(cycles, &regs->ADJ_NSEC);
+	cr = readl(&regs->CR) & ~PPSG_CR_CNT_ADJ;
+	writel(cr | PPSG_CR_CNT_SET, &regs->CR);
+}
+
+/* CNT_ADJ reads back as 0 while an adjustment is in progress */
+static int __wrn_ppsg_wait(struct wrn_dev *wrn)
+{
+	unsigned long j = jiffies + WRN_PPSG_ADJ_TIMEOUT;
+
+	while (!(readl(&wrn->ppsg_regs->CR) & PPSG_CR_CNT_ADJ)) {
+		if (time_after(jiffies, j))
+			return -EBUSY;
+		msleep(10);
+	}
+	return 0;
+}
 
-	if (utc2 != utc1)
-		cnt = readl(&wrn->ppsg_regs->CNTR_NSEC);
+/*
+ * Add a signed offset to the counters. May sleep, as the hardware
+ * applies it over the current second. Like the WR core software, the
+ * caller adjusts seconds and cycles in separate calls.
+ */
+int wrn_ppsg_adjust(struct wrn_dev *wrn, s64 sec, s32 cycles)
+{
+	struct PPSG_WB __iomem *regs = wrn->ppsg_regs;
+	int err;
 
-	*utc = utc2;
-	*fine_counter = cnt;
+	err = __wrn_ppsg_wait(wrn);
+	if (err)
+		return err;
+	writel((u32)sec, &regs->ADJ_UTCLO);
+	writel(((u64)sec >> 32) & 0xff, &regs->ADJ_UTCHI);
+	writel(cycles, &regs->ADJ_NSEC);
+	writel(readl(&regs->CR) | PPSG_CR_CNT_ADJ, &regs->CR);
+	return __wrn_ppsg_wait(wrn);
 }
@@ -0,0 +1,166 @@
+/*
+ * PTP hardware clock, reporting the White Rabbit time of the PPS generator
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+#include <linux/ptp_clock_kernel.h>
+
+#include "wr-nic.h"
+
+#undef WRN_PTP_TIMESPEC64
+#if KERNEL_VERSION(3, 19, 0) <= LINUX_VERSION_CODE
+#define WRN_PTP_TIMESPEC64
+#endif
+
+#undef WRN_PTP_GETTIMEX
+#if KERNEL_VERSION(5, 0, 0) <= LINUX_VERSION_CODE
+#define WRN_PTP_GETTIMEX
+#endif
+
+#ifdef WRN_PTP_TIMESPEC64
+#define wrn_ptp_timespec timespec64
+#else
+#define wrn_ptp_timespec timespec
+#endif
+
+/* Read the clock, and account the system-time window of the read */
+static void wrn_ptp_read(struct wrn_dev *wrn, struct wrn_ptp_timespec *ts,
+			 struct ptp_system_timestamp *sts)
+{
+	struct wrn_ptp_stats *st = &wrn->ptp_stats;
+	ktime_t t0, t1;
+	u64 sec;
+	u32 cycles, ns;
+	int retries;
+
+	retries = wrn_ppsg_get_time(wrn, &sec, &cycles, &t0, &t1, sts);
+	ts->tv_sec = sec;
+	ts->tv_nsec = cycles * NSEC_PER_TICK;
+
+	/* Not locked: concurrent readers may lose an update of stats */
+	ns = ktime_to_ns(ktime_sub(t1, t0));
+	st->retries += retries;
+	st->last_ns = ns;
+	if (!st->reads || ns < st->min_ns)
+		st->min_ns = ns;
+	if (ns > st->max_ns)
+		st->max_ns = ns;
+	st->reads++;
+}
+
+static int wrn_ptp_gettime(struct ptp_clock_info *ptp,
+			   struct wrn_ptp_timespec *ts)
+{
+	struct wrn_dev *wrn = container_of(ptp, struct wrn_dev, ptp_info);
+
+	wrn_ptp_read(wrn, ts, NULL);
+	return 0;
+}
+
+#ifdef WRN_PTP_GETTIMEX
+/* PTP_SYS_OFFSET_EXTENDED: system time right around the nsec counter */
+static int wrn_ptp_gettimex(struct ptp_clock_info *ptp,
+			    struct timespec64 *ts,
+			    struct ptp_system_timestamp *sts)
+{
+	struct wrn_dev *wrn = container_of(ptp, struct wrn_dev, ptp_info);
+
+	wrn_ptp_read(wrn, ts, sts);
+	return 0;
+}
+#endif
+
+static int wrn_ptp_settime(struct ptp_clock_info *ptp,
+			   const struct wrn_ptp_timespec *ts)
+{
+	struct wrn_dev *wrn = container_of(ptp, struct wrn_dev, ptp_info);
+
+	mutex_lock(&wrn->ptp_lock);
+	wrn_ppsg_set_time(wrn, ts->tv_sec, ts->tv_nsec / NSEC_PER_TICK);
+	mutex_unlock(&wrn->ptp_lock);
+	return 0;
+}
+
+static int wrn_ptp_adjtime(struct ptp_clock_info *ptp, s64 delta)
+{
+	struct wrn_dev *wrn = container_of(ptp, struct wrn_dev, ptp_info);
+	s64 sec;
+	s32 nsec;
+	int err = 0;
+
+	sec = div_s64_rem(delta, NSEC_PER_SEC, &nsec);
+	mutex_lock(&wrn->ptp_lock);
+	if (sec)
+		err = wrn_ppsg_adjust(wrn, sec, 0);
+	if (!err && nsec / NSEC_PER_TICK)
+		err = wrn_ppsg_adjust(wrn, 0, nsec / NSEC_PER_TICK);
+	mutex_unlock(&wrn->ptp_lock);
+	return err;
+}
+
+/* The frequency is locked by White Rabbit: we can't change it */
+static int wrn_ptp_adjfreq(struct ptp_clock_info *ptp, s32 ppb)
+{
+	return ppb ? -EOPNOTSUPP : 0;
+}
+
+static int wrn_ptp_enable(struct ptp_clock_info *ptp,
+			  struct ptp_clock_request *rq, int on)
+{
+	return -EOPNOTSUPP;
+}
+
+static struct ptp_clock_info wrn_ptp_info = {
+	.owner		= THIS_MODULE,
+	.name		= DRV_NAME,
+	.max_adj	= 0,
+	.adjfreq	= wrn_ptp_adjfreq,
+	.adjtime	= wrn_ptp_adjtime,
+#ifdef WRN_PTP_GETTIMEX
+	.gettimex64	= wrn_ptp_gettimex,
+#endif
+#ifdef WRN_PTP_TIMESPEC64
+	.gettime64	= wrn_ptp_gettime,
+	.settime64	= wrn_ptp_settime,
+#else
+	.gettime	= wrn_ptp_gettime,
+	.settime	= wrn_ptp_settime,
+#endif
+	.enable		= wrn_ptp_enable,
+};
+
+int wrn_ptp_init(struct wrn_dev *wrn, struct device *parent)
+{
+	struct ptp_clock *clock;
+
+	mutex_init(&wrn->ptp_lock);
+	wrn->ptp_info = wrn_ptp_info;
+	clock = ptp_clock_register(&wrn->ptp_info, parent);
+	if (IS_ERR(clock))
+		return PTR_ERR(clock);
+	wrn->ptp_clock = clock; /* NULL if ptp clocks are not configured */
+	return 0;
+}
+
+void wrn_ptp_exit(struct wrn_dev *wrn)
+{
+	if (wrn->ptp_clock)
+		ptp_clock_unregister(wrn->ptp_clock);
+	wrn->ptp_clock = NULL;
+}
+
+int wrn_ptp_index(struct wrn_dev *wrn)
+{
+	if (!wrn->ptp_clock)
+		return -1;
+	return ptp_clock_index(wrn->ptp_clock);
+}
@@ -0,0 +1,169 @@
+/*
+ * A read-only page with the White Rabbit time, for user space (../wr-time.h)
+ *
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/timer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/platform_device.h>
+
+#include "wr-nic.h"
+
+/*
+ * Take a snapshot of WR time and host time. The host time is the middle
+ * of the window around the nanosecond read, converted from realtime to
+ * monotonic; the offset between them is read back-to-back, so its error
+ * is much smaller than the window itself.
+ */
+static void wrn_timepage_update(struct wrn_dev *wrn)
+{
+	struct wr_time_page *p = wrn->time_page;
+	ktime_t pre, post, mono;
+	s64 host, wr, offset, expected, elapsed;
+	int rate = p->rate_ppb, flags = p->flags;
+	u64 sec;
+	u32 cycles;
+
+	wrn_ppsg_get_time(wrn, &sec, &cycles, &pre, &post, NULL);
+	mono = ktime_sub(ktime_get(), ktime_get_real());
+	host = ktime_to_ns(ktime_add(pre, mono))
+		+ ktime_to_ns(ktime_sub(post, pre)) / 2;
+	wr = sec * NSEC_PER_SEC + cycles * NSEC_PER_TICK;
+	offset = wr - host;
+
+	/* If WR time was set or adjusted, restart the rate measurement */
+	elapsed = host - wrn->time_last_host;
+	expected = wrn->time_last_offset + div64_s64(elapsed * rate,
+						     NSEC_PER_SEC);
+	if (!wrn->time_base_host || offset - expected > WRN_TIME_JUMP
+	    || expected - offset > WRN_TIME_JUMP) {
+		wrn->time_base_host = host;
+		wrn->time_base_wr = wr;
+	}
+	wrn->time_last_host = host;
+	wrn->time_last_offset = offset;
+
+	/* The rate is measured over a long period, for a precise figure */
+	elapsed = host - wrn->time_base_host;
+	if (elapsed >= WRN_TIME_RATE_PERIOD) {
+		rate = div64_s64((wr - wrn->time_base_wr - elapsed)
+				 * NSEC_PER_SEC, elapsed);
+		flags |= WR_TIME_F_RATE;
+		wrn->time_base_host = host;
+		wrn->time_base_wr = wr;
+	}
+
+	/* Same as write_seqcount_begin/end, but the counter is in the page */
+	p->seq++;
+	smp_wmb();
+	p->flags = flags | WR_TIME_F_VALID;
+	p->host_ns = host;
+	p->offset_ns = offset;
+	p->rate_ppb = rate;
+	p->wr_nsec = cycles * NSEC_PER_TICK;
+	p->wr_sec = sec;
+	p->updates++;
+	smp_wmb();
+	p->seq++;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+static void wrn_timepage_timer(unsigned long data)
+{
+	struct wrn_dev *wrn = (struct wrn_dev *)data;
+#else
+static void wrn_timepage_timer(struct timer_list *t)
+{
+	struct wrn_dev *wrn = from_timer(wrn, t, time_timer);
+#endif
+
+	wrn_timepage_update(wrn);
+	mod_timer(&wrn->time_timer, jiffies + WRN_TIME_PERIOD);
+}
+
+static int wrn_timepage_open(struct inode *inode, struct file *f)
+{
+	struct miscdevice *mdev = f->private_data;
+
+	f->private_data = container_of(mdev, struct wrn_dev, time_mdev);
+	return 0;
+}
+
+/* The page is refcounted, so it survives rmmod while still mapped */
+static int wrn_timepage_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	struct wrn_dev *wrn = f->private_data;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return vm_insert_page(vma, vma->vm_start,
+			      virt_to_page(wrn->time_page));
+}
+
+static const struct file_operations wrn_timepage_fops = {
+	.owner = THIS_MODULE,
+	.open = wrn_timepage_open,
+	.mmap = wrn_timepage_mmap,
+};
+
+int wrn_timepage_init(struct wrn_dev *wrn, struct device *parent)
+{
+	int err;
+
+	BUILD_BUG_ON(sizeof(struct wr_time_page) > PAGE_SIZE);
+	wrn->time_page = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!wrn->time_page)
+		return -ENOMEM;
+	wrn_timepage_update(wrn);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+	setup_timer(&wrn->time_timer, wrn_timepage_timer,
+		    (unsigned long)wrn);
+#else
+	timer_setup(&wrn->time_timer, wrn_timepage_timer, 0);
+#endif
+	mod_timer(&wrn->time_timer, jiffies + WRN_TIME_PERIOD);
+
+	/*
+	 * One per card, named after the card: "wr-time0". Interfaces may
+	 * be renamed later, so user space finds it from sysfs, in the
+	 * "misc" directory of the parent device of the interface.
+	 */
+	snprintf(wrn->time_name, sizeof(wrn->time_name), "wr-time%i",
+		 to_platform_device(parent)->id);
+	wrn->time_mdev.minor = MISC_DYNAMIC_MINOR;
+	wrn->time_mdev.name = wrn->time_name;
+	wrn->time_mdev.fops = &wrn_timepage_fops;
+	wrn->time_mdev.parent = parent;
+	err = misc_register(&wrn->time_mdev);
+	if (err) {
+		del_timer_sync(&wrn->time_timer);
+		free_page((unsigned long)wrn->time_page);
+		wrn->time_page = NULL;
+	}
+	return err;
+}
+
+void wrn_timepage_exit(struct wrn_dev *wrn)
+{
+	if (!wrn->time_page)
+		return;
+	misc_deregister(&wrn->time_mdev);
+	del_timer_sync(&wrn->time_timer);
+	free_page((unsigned long)wrn->time_page);
+	wrn->time_page = NULL;
+}
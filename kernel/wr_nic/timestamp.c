@@ -9,9 +9,14 @@
  * published by the Free Software Foundation.
  */
 #include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/timer.h>
 #include <linux/netdevice.h>
 #include <linux/sockios.h>
 #include <linux/net_tstamp.h>
+#include <linux/if_ether.h>
+#include <linux/if_vlan.h>
+#include <linux/in.h>
 
 #include "wr-nic.h"
 
@@ -21,31 +26,25 @@ void wrn_tx_tstamp_skb(struct wrn_dev *wrn, int desc)
 	struct skb_shared_hwtstamps *hwts;
 	struct wrn_desc_pending	 *d = wrn->skb_desc + desc;
 	struct sk_buff *skb = d->skb;
-	struct timespec ts;
-	u32 counter_ppsg; /* PPS generator nanosecond counter */
-	u32 utc;
+	u64 sec;
+	u32 cycles; /* PPS generator nanosecond counter */
 
 	if (!wrn->skb_desc[desc].valid)
 		return;
+	/* Like xmit and the timestamp irq, take ownership of the skb */
+	if (!skb || cmpxchg(&d->skb, skb, NULL) != skb)
+		return;
 
 	/* already reported by hardware: do the timestamping magic */
-	wrn_ppsg_read_time(wrn, &counter_ppsg, &utc);
-
-	/* We may be at the beginning og the next second */
-	if (counter_ppsg < d->cycles)
-		utc--;
-
-	ts.tv_sec = (s32)utc & 0x7fffffff;
-	ts.tv_nsec = d->cycles * NSEC_PER_TICK;
+	wrn_ppsg_get_time(wrn, &sec, &cycles, NULL, NULL, NULL);
 	if (!(d->valid & TS_INVALID)) {
 		hwts = skb_hwtstamps(skb);
-		hwts->hwtstamp = timespec_to_ktime(ts);
+		hwts->hwtstamp = wrn_stamp_to_ktime(sec, cycles, d->cycles);
 		skb_tstamp_tx(skb, hwts);
 	}
 	dev_kfree_skb_irq(skb);
 
-	/* release both the descriptor and the tstamp entry */
-	d->skb = 0;
+	/* release the tstamp entry (the descriptor is already released) */
 	d->valid = 0;
 }
 
@@ -55,67 +54,193 @@ static int record_tstamp(struct wrn_dev *wrn, u32 tsval, u32 idreg, u32 r2)
 	int frame_id = TXTSU_TSF_R1_FID_R(idreg);
 	int ts_incorrect = r2 & TXTSU_TSF_R2_INCORRECT;
 	struct skb_shared_hwtstamps *hwts;
-	struct timespec ts;
+	struct wrn_desc_pending *d;
 	struct sk_buff *skb;
-	u32 utc, counter_ppsg; /* PPS generator nanosecond counter */
+	u64 sec;
+	u32 cycles; /* PPS generator nanosecond counter */
 	int i;
 
-	/* Find the skb in the descriptor array */
-	for (i = 0; i < WRN_NR_DESC; i++)
-		if (wrn->skb_desc[i].skb
-		    && wrn->skb_desc[i].frame_id == frame_id)
-			break;
-
-	if (i == WRN_NR_DESC) {
-		/* Not found: Must be a PTP frame sent from the SPEC! */
+	/*
+	 * The frame id tells the descriptor (see wrn_start_xmit). Xmit
+	 * doesn't lock: it sets frame_id before skb, and whoever clears
+	 * skb owns it.
+	 */
+	i = frame_id & WRN_FID_DESC_MASK;
+	if (i >= WRN_NR_TXDESC) {
+		/* Must be a PTP frame sent from the SPEC! */
+		wrn->tstamp_stats.unmatched++;
 		return 0;
 	}
-
-	skb = wrn->skb_desc[i].skb;
-
-	wrn_ppsg_read_time(wrn, &counter_ppsg, &utc);
-
-	if (counter_ppsg < (tsval & 0xfffffff))
-		utc--;
-
-	ts.tv_sec = (s32)utc & 0x7fffffff;
-	ts.tv_nsec = (tsval & 0xfffffff) * NSEC_PER_TICK;
+	d = wrn->skb_desc + i;
+	skb = d->skb;
+	smp_rmb();
+	if (!skb || d->frame_id != frame_id) {
+		/* Sent from the SPEC, or the frame was already released */
+		wrn->tstamp_stats.unmatched++;
+		return 0;
+	}
+	if (cmpxchg(&d->skb, skb, NULL) != skb)
+		return 0; /* released by xmit or the timer meanwhile */
+	wrn->tstamp_stats.stamps++;
 
 	/* Provide the timestamp  only if 100% sure about its correctness */
 	if (!ts_incorrect) {
+		wrn_ppsg_get_time(wrn, &sec, &cycles, NULL, NULL, NULL);
 		hwts = skb_hwtstamps(skb);
-		hwts->hwtstamp = timespec_to_ktime(ts);
+		hwts->hwtstamp = wrn_stamp_to_ktime(sec, cycles,
+						    tsval & 0xfffffff);
 		skb_tstamp_tx(skb, hwts);
 	}
 	dev_kfree_skb_irq(skb);
-	wrn->skb_desc[i].skb = 0;
 	return 0;
 }
 
+/*
+ * The irq reports the fifo is not empty: ack first, so new entries
+ * raise it again, then drain all entries we find.
+ */
 irqreturn_t wrn_tstamp_interrupt(int irq, void *dev_id)
 {
 	struct wrn_dev *wrn = dev_id;
 	struct TXTSU_WB *regs = wrn->txtsu_regs;
-	u32 r0, r1, r2;
+	struct wrn_tstamp_stats *st = &wrn->tstamp_stats;
+	u32 r0, r1, r2, csr;
+	int n;
 
 	if (!regs)
 		return IRQ_NONE; /* early interrupt? */
 
+	writel(TXTSU_EIC_IER_NEMPTY, &wrn->txtsu_regs->EIC_ISR); /* ack irq */
+
 	/* printk("%s: %i\n", __func__, __LINE__); */
-	/* FIXME: locking */
-	r0 = readl(&regs->TSF_R0);
-	r1 = readl(&regs->TSF_R1);
-	r2 = readl(&regs->TSF_R2);
+	csr = readl(&regs->TSF_CSR);
+	if (csr & TXTSU_TSF_CSR_FULL)
+		st->fifo_full++; /* stamps may have been lost */
 
-	record_tstamp(wrn, r0, r1, r2);
-	writel(TXTSU_EIC_IER_NEMPTY, &wrn->txtsu_regs->EIC_ISR); /* ack irq */
+	for (n = 0; !(csr & TXTSU_TSF_CSR_EMPTY) && n < WRN_TXTSU_FIFO_LEN;
+	     n++) {
+		r0 = readl(&regs->TSF_R0);
+		r1 = readl(&regs->TSF_R1);
+		r2 = readl(&regs->TSF_R2);
+		record_tstamp(wrn, r0, r1, r2);
+		csr = readl(&regs->TSF_CSR);
+	}
+
+	st->irqs++;
+	st->fifo_entries += n;
+	if (n > st->fifo_max)
+		st->fifo_max = n;
 	return IRQ_HANDLED;
 }
 
+/*
+ * Look for a PTPv2 header in a received frame (data is the Ethernet
+ * header). Event messages over UDP go to port 319; we don't bother
+ * with IPv6 extension headers, nor with IPv4 fragments.
+ */
+#define WRN_PTP_EVENT_PORT	319
+
+int wrn_rx_ptp_match(u32 mask, const u8 *data, int len)
+{
+	int off = ETH_HLEN, trans;
+	u16 proto;
+
+	if (len < ETH_HLEN)
+		return 0;
+	proto = (data[12] << 8) | data[13];
+	if (proto == ETH_P_8021Q && len >= VLAN_ETH_HLEN) {
+		proto = (data[16] << 8) | data[17];
+		off = VLAN_ETH_HLEN;
+	}
+
+	switch (proto) {
+	case ETH_P_1588:
+		trans = WRN_RXF_L2;
+		break;
+	case ETH_P_IP:
+		if (len < off + 20 || (data[off] >> 4) != 4)
+			return 0;
+		if (data[off + 9] != IPPROTO_UDP
+		    || ((data[off + 6] << 8 | data[off + 7]) & 0x3fff))
+			return 0;
+		off += (data[off] & 0x0f) * 4;
+		goto udp;
+	case ETH_P_IPV6:
+		if (len < off + 40 || data[off + 6] != IPPROTO_UDP)
+			return 0;
+		off += 40;
+	udp:
+		if (len < off + 8)
+			return 0;
+		if (((data[off + 2] << 8) | data[off + 3])
+		    != WRN_PTP_EVENT_PORT)
+			return 0;
+		off += 8;
+		trans = WRN_RXF_L4;
+		break;
+	default:
+		return 0;
+	}
+
+	/* messageType in the low nibble of byte 0, versionPTP in byte 1 */
+	if (!(mask & trans) || len < off + 2 || (data[off + 1] & 0x0f) != 2)
+		return 0;
+	return (mask & WRN_RXF_MSG(data[off] & 0x0f)) != 0;
+}
+
+/* Return the filter we grant, and fill the mask for wrn_rx_filter() */
+static int wrn_rx_filter_grant(int filter, u32 *mask)
+{
+	u32 trans = WRN_RXF_L2 | WRN_RXF_L4;
+	int base = HWTSTAMP_FILTER_PTP_V2_EVENT;
+
+	switch (filter) {
+	case HWTSTAMP_FILTER_NONE:
+		*mask = 0;
+		return filter;
+
+	case HWTSTAMP_FILTER_PTP_V2_L4_EVENT:
+	case HWTSTAMP_FILTER_PTP_V2_L4_SYNC:
+	case HWTSTAMP_FILTER_PTP_V2_L4_DELAY_REQ:
+		trans = WRN_RXF_L4;
+		base = HWTSTAMP_FILTER_PTP_V2_L4_EVENT;
+		break;
+	case HWTSTAMP_FILTER_PTP_V2_L2_EVENT:
+	case HWTSTAMP_FILTER_PTP_V2_L2_SYNC:
+	case HWTSTAMP_FILTER_PTP_V2_L2_DELAY_REQ:
+		trans = WRN_RXF_L2;
+		base = HWTSTAMP_FILTER_PTP_V2_L2_EVENT;
+		break;
+	case HWTSTAMP_FILTER_PTP_V2_EVENT:
+	case HWTSTAMP_FILTER_PTP_V2_SYNC:
+	case HWTSTAMP_FILTER_PTP_V2_DELAY_REQ:
+		break;
+
+	default: /* PTPv1, NTP and the like: we can only stamp everything */
+		*mask = WRN_RXF_ALL;
+		return HWTSTAMP_FILTER_ALL;
+	}
+
+	/* The three variants are in the same order for each transport */
+	switch (filter - base) {
+	case 0:
+		*mask = trans | WRN_RXF_EVENT;
+		break;
+	case 1:
+		*mask = trans | WRN_RXF_MSG(0); /* Sync */
+		break;
+	default:
+		*mask = trans | WRN_RXF_MSG(1); /* Delay_Req */
+		break;
+	}
+	return filter;
+}
+
 int wrn_tstamp_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 {
 	struct wrn_ep *ep = netdev_priv(dev);
 	struct hwtstamp_config config;
+	u32 mask;
 
 	if (copy_from_user(&config, rq->ifr_data, sizeof(config)))
 		return -EFAULT;
@@ -140,29 +265,70 @@ int wrn_tstamp_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 	}
 
 	/*
-	 * For the time being, make this really simple and stupid: either
-	 * time-tag _all_ the incoming packets or none of them.
+	 * The endpoint stamps all frames, also for the soft-core that
+	 * shares it, so we don't touch EP_TSCR: frames not matching the
+	 * filter just don't get their stamp converted in __wrn_rx_descriptor.
 	 */
-	switch (config.rx_filter) {
-	case HWTSTAMP_FILTER_NONE:
-		/* FIXME: disable rx in hardware */
-		clear_bit(WRN_EP_STAMPING_RX, &ep->ep_flags);
-		break;
-
-	default: /* All other case: activate stamping */
-		/* FIXME: enable rx in hardware */
+	config.rx_filter = wrn_rx_filter_grant(config.rx_filter, &mask);
+	ep->rx_filter = config.rx_filter;
+	ep->rx_filter_mask = mask;
+	if (mask)
 		set_bit(WRN_EP_STAMPING_RX, &ep->ep_flags);
-
-		break;
-	}
-
-	/* FIXME: minic_update_ts_config(nic); */
+	else
+		clear_bit(WRN_EP_STAMPING_RX, &ep->ep_flags);
 
 	if (copy_to_user(rq->ifr_data, &config, sizeof(config)))
 		return -EFAULT;
 	return 0;
 }
 
+/*
+ * Frames whose timestamp doesn't come are released after a timeout.
+ * As in the irq above, whoever clears the skb pointer owns the skb
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+static void wrn_tstamp_timeout(unsigned long data)
+{
+	struct wrn_dev *wrn = (struct wrn_dev *)data;
+#else
+static void wrn_tstamp_timeout(struct timer_list *t)
+{
+	struct wrn_dev *wrn = from_timer(wrn, t, tstamp_timer);
+#endif
+	struct wrn_desc_pending *d;
+	struct sk_buff *skb;
+	int i, pending = 0;
+
+	for (i = 0; i < WRN_NR_TXDESC; i++) {
+		d = wrn->skb_desc + i;
+		skb = d->skb;
+		smp_rmb();
+		if (!skb || !d->stamp)
+			continue;
+		if (time_before(jiffies, d->stamp_deadline)) {
+			pending++;
+			continue;
+		}
+		if (cmpxchg(&d->skb, skb, NULL) != skb)
+			continue;
+		wrn->tstamp_stats.timeouts++;
+		dev_kfree_skb_any(skb);
+	}
+	if (pending)
+		mod_timer(&wrn->tstamp_timer, jiffies + WRN_TSTAMP_TIMEOUT);
+}
+
+/* Called early at probe time, so wrn_remove() can always stop the timer */
+void wrn_tstamp_setup(struct wrn_dev *wrn)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+	setup_timer(&wrn->tstamp_timer, wrn_tstamp_timeout,
+		    (unsigned long)wrn);
+#else
+	timer_setup(&wrn->tstamp_timer, wrn_tstamp_timeout, 0);
+#endif
+}
+
 void wrn_tstamp_init(struct wrn_dev *wrn)
 {
 	/* enable TXTSU irq */
@@ -30,8 +30,13 @@
 #include <linux/mii.h>		/* Needed for stuct mii_if_info in wrn_dev */
 #include <linux/netdevice.h>	/* Needed for net_device_stats in wrn_dev */
 #include <linux/timer.h>	/* Needed for struct time_list in wrn_dev*/
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/ptp_clock_kernel.h> /* struct ptp_clock_info in wrn_dev */
+#include <linux/miscdevice.h>
 
 #include "nic-hardware.h" /* Magic numbers: please fix them as needed */
+#include "../wr-time.h"
 
 #define DRV_NAME "wr-nic" /* Used in messages and device/driver names */
 #define DRV_VERSION "0.1" /* For ethtool->get_drvinfo -- FIXME: auto-vers */
@@ -64,12 +69,97 @@ struct wrn_desc_pending {
 	u8 port_id;
 	u16 frame_id;
 	u32 cycles;
+	unsigned int len; /* for byte queue limits */
+	int fired; /* set by xmit once the hardware owns the descriptor */
+	int stamp; /* the skb waits for its timestamp... */
+	unsigned long stamp_deadline; /* ...and is released after this */
 };
 
+/*
+ * Frame ids carry the descriptor number in the low bits, so the
+ * timestamp irq finds its descriptor without a scan
+ */
+#define WRN_FID_DESC_BITS	3
+#define WRN_FID_DESC_MASK	((1 << WRN_FID_DESC_BITS) - 1)
+
+/* A tx timestamp comes a few microseconds after the frame is sent */
+#define WRN_TSTAMP_TIMEOUT	(HZ / 10)
+
+/* At close, frames still in the tx ring are waited for this long */
+#define WRN_TX_DRAIN_TIMEOUT	(HZ / 10)
+
 /* bits for "valid" field */
 #define TS_PRESENT 1
 #define TS_INVALID 2 /* as reported by hw: we return 0 as timestamp */
 
+/* Frames processed at most in one napi poll, for rx and tx */
+#define WRN_NAPI_WEIGHT		NAPI_POLL_WEIGHT
+#define WRN_TX_BUDGET		(2 * WRN_NR_TXDESC)
+
+/*
+ * Rx buffers are page fragments, turned into skbs by build_skb(). They
+ * fit an MTU-sized frame, the copy slack and the shared info. The pool
+ * is as large as a napi budget, so a poll never runs dry unless memory
+ * is short.
+ */
+#define WRN_RX_HEADROOM		(NET_SKB_PAD + WRN_DDATA_OFFSET)
+#define WRN_RX_BUFSIZE	(SKB_DATA_ALIGN(WRN_RX_HEADROOM + WRN_MTU + 4) \
+			 + SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+#define WRN_RX_POOL_SIZE	WRN_NAPI_WEIGHT
+
+/*
+ * Reads of the ptp clock: the system time is sampled around the read
+ * of the nsec counter, and the width of that window is the jitter of
+ * PTP_SYS_OFFSET_EXTENDED. Reported by "ethtool -S" (see ethtool.c)
+ */
+struct wrn_ptp_stats {
+	u64 reads;
+	u64 retries; /* the second changed during the read */
+	u64 last_ns, min_ns, max_ns;
+};
+
+/* Timestamps: tx ones delivered and lost, fifo use, rx time reads */
+struct wrn_tstamp_stats {
+	u64 stamps;
+	u64 unmatched; /* not our frame (e.g. sent by the card) or stale */
+	u64 timeouts; /* the frame was released without its stamp */
+	u64 discarded; /* the descriptor was needed before the timeout */
+	u64 irqs;
+	u64 fifo_entries; /* drained by all irqs: compare with irqs */
+	u64 fifo_max; /* drained by a single irq */
+	u64 fifo_full; /* seen at irq time: entries may be lost */
+	u64 rx_ppsg_reads; /* time snapshots for rx, see nic-core.c */
+};
+
+/* Rx stamps take their seconds from a snapshot, valid for one poll */
+struct wrn_ppsg_snap {
+	u64 sec; /* 40 bits */
+	u32 cycles;
+	int valid;
+	ktime_t taken; /* monotonic, to check the age */
+};
+
+/*
+ * A hardware stamp only counts cycles: the seconds come from a later
+ * reading of the time, minus one if the cycle counter wrapped since.
+ */
+static inline ktime_t wrn_stamp_to_ktime(u64 sec, u32 now_cycles, u32 cycles)
+{
+	if (now_cycles < cycles && sec)
+		sec--;
+	return ktime_set(sec, cycles * NSEC_PER_TICK);
+}
+
+/*
+ * Near the end of a second (10ms), a snapshot is taken for each frame;
+ * a snapshot older than the same 10ms is taken again, too.
+ */
+#define WRN_PPSG_SNAP_GUARD	(REFCLK_FREQ / 100)
+#define WRN_PPSG_SNAP_AGE_NS	(WRN_PPSG_SNAP_GUARD * NSEC_PER_TICK)
+
+/* The timestamp unit fifo has 256 entries (TSF_CSR_USEDW is 8 bits) */
+#define WRN_TXTSU_FIFO_LEN	256
+
 /*
  * This is the main data structure for our NIC device. As for locking,
  * the rule is that _either_ the wrn _or_ the endpoint is locked. Not both.
@@ -83,16 +173,27 @@ struct wrn_dev {
 	struct PPSG_WB __iomem *ppsg_regs; /* ... */
 
 	spinlock_t		lock;
-	struct tasklet_struct	rx_tlet;
+	struct napi_struct	napi; /* rx and tx-done, for all endpoints */
+	struct net_device	napi_dev; /* dummy device to host the napi */
 	struct wrn_txd __iomem	*txd;
 	struct wrn_rxd __iomem	*rxd;
 	void __iomem		*databuf; /* void to ease pointer arith */
+	/*
+	 * The tx ring has a single producer (xmit: we have one endpoint,
+	 * and the core serializes its xmit) and a single consumer (the
+	 * napi poll). Each one owns its index; tx_count publishes slots.
+	 */
 	int			next_tx_head, next_tx_tail;
 	int			next_rx;
+	atomic_t		tx_count; /* tx descriptors in flight */
 
 	/* For TX descriptors, we must keep track of the ownwer */
 	struct wrn_desc_pending	skb_desc[WRN_NR_TXDESC];
-	int			id;
+	int			id; /* frame id, only used by xmit */
+
+	/* Rx buffers, refilled by the napi poll (see nic-core.c) */
+	void			*rx_pool[WRN_RX_POOL_SIZE];
+	int			rx_pool_count;
 
 	struct net_device	*dev[WRN_NR_ENDPOINTS];
 
@@ -106,9 +207,36 @@ struct wrn_dev {
 
 	int use_count; /* only used at probe time */
 	int irq_registered;
+	int napi_enabled;
+
+	/* The ptp clock is the WR time of the pps generator (ptp.c) */
+	struct ptp_clock_info	ptp_info;
+	struct ptp_clock	*ptp_clock;
+	struct mutex		ptp_lock; /* serializes set and adjust */
+	struct wrn_ptp_stats	ptp_stats;
+
+	struct timer_list	tstamp_timer; /* releases stale tx frames */
+	struct wrn_tstamp_stats	tstamp_stats;
+
+	/* The WR time page for user space (timepage.c) */
+	struct miscdevice	time_mdev;
+	char			time_name[IFNAMSIZ + 8];
+	struct wr_time_page	*time_page;
+	struct timer_list	time_timer;
+	s64			time_base_host, time_base_wr; /* for the rate */
+	s64			time_last_host, time_last_offset;
 };
 
-/* We need to disable the rx-complete interrupt, so get the masks */
+/* The time page is refreshed often, the rate is measured over 10s */
+#define WRN_TIME_PERIOD		(HZ / 10)
+#define WRN_TIME_RATE_PERIOD	(10LL * NSEC_PER_SEC)
+#define WRN_TIME_JUMP		(100 * NSEC_PER_USEC) /* WR time was set */
+
+/* An adjustment of the pps generator is applied within a second */
+#define WRN_PPSG_ADJ_TIMEOUT	(2 * HZ)
+
+
+/* We need to disable the completion interrupts, so get the masks */
 #define WRN_IRQ_ALL		(~0)
 #define WRN_IRQ_ALL_BUT_RX	(~NIC_EIC_IER_RCOMP)
 #define WRN_IRQ_NONE		0
@@ -123,6 +251,8 @@ struct wrn_ep {
 	struct mii_if_info	mii; /* for ethtool operations */
 	int			ep_number;
 	int			pkt_count; /* used for tx stamping ID */
+	int			rx_filter; /* HWTSTAMP_FILTER_, as granted */
+	u32			rx_filter_mask; /* WRN_RXF_ bits, see below */
 
 	struct net_device_stats	stats;
 	//struct sk_buff		*current_skb;
@@ -141,6 +271,17 @@ enum ep_flags { /* only used in the ep_flags register */
 	WRN_EP_STAMPING_RX	= 3,
 };
 
+/*
+ * The endpoint stamps all frames, but we only convert stamps for the
+ * frames accepted by the rx filter: a mask of PTP message types and
+ * transports, or WRN_RXF_ALL to stamp everything.
+ */
+#define WRN_RXF_MSG(type)	(1 << (type))	/* PTP messageType, 0..15 */
+#define WRN_RXF_EVENT		0x000f		/* Sync to Pdelay_Resp */
+#define WRN_RXF_L2		0x10000		/* PTP over Ethernet */
+#define WRN_RXF_L4		0x20000		/* PTP over UDP, v4 or v6 */
+#define WRN_RXF_ALL		(~0U)
+
 /* Our resources. */
 enum wrn_resnames {
 	/*
@@ -210,9 +351,11 @@ struct wrn_phase_req {
 /* Following functions are in nic-core.c */
 extern irqreturn_t wrn_interrupt(int irq, void *dev_id);
 extern int wrn_netops_init(struct net_device *netdev);
-extern void wrn_rx_interrupt(unsigned long arg); /* tasklet */
+extern int wrn_poll(struct napi_struct *napi, int budget); /* napi */
+extern void wrn_rx_pool_fill(struct wrn_dev *wrn);
+extern void wrn_rx_pool_free(struct wrn_dev *wrn);
 
-/* Following data in device.c */
+/* Following data and functions in device.c */
 struct platform_driver;
 extern struct platform_driver wrn_driver;
 
@@ -233,12 +376,40 @@ extern void wrn_endpoint_remove(struct net_device *netdev);
 extern void wrn_tx_tstamp_skb(struct wrn_dev *wrn, int desc);
 extern int wrn_tstamp_ioctl(struct net_device *dev, struct ifreq *rq, int cmd);
 extern irqreturn_t wrn_tstamp_interrupt(int irq, void *dev_id);
+extern void wrn_tstamp_setup(struct wrn_dev *wrn);
 extern void wrn_tstamp_init(struct wrn_dev *wrn);
+extern int wrn_rx_ptp_match(u32 mask, const u8 *data, int len);
+
+/* Called for each received frame, before eth_type_trans() */
+static inline int wrn_rx_filter(struct wrn_ep *ep, struct sk_buff *skb)
+{
+	u32 mask = ep->rx_filter_mask;
+
+	if (mask == WRN_RXF_ALL)
+		return 1;
+	if (!mask)
+		return 0;
+	return wrn_rx_ptp_match(mask, skb->data, skb->len);
+}
 
 /* Following functions from dmtd.c and pps.c */
 extern int wrn_phase_ioctl(struct net_device *dev, struct ifreq *rq, int cmd);
 extern int wrn_calib_ioctl(struct net_device *dev, struct ifreq *rq, int cmd);
-extern void wrn_ppsg_read_time(struct wrn_dev *wrn, u32 *fine_cnt, u32 *utc);
+struct ptp_system_timestamp; /* only known since 5.0 */
+extern int wrn_ppsg_get_time(struct wrn_dev *wrn, u64 *sec, u32 *cycles,
+			     ktime_t *pre, ktime_t *post,
+			     struct ptp_system_timestamp *sts);
+extern void wrn_ppsg_set_time(struct wrn_dev *wrn, u64 sec, u32 cycles);
+extern int wrn_ppsg_adjust(struct wrn_dev *wrn, s64 sec, s32 cycles);
+
+/* Following functions from ptp.c, weak if the kernel has no ptp clocks */
+extern int wrn_ptp_init(struct wrn_dev *wrn, struct device *parent);
+extern void wrn_ptp_exit(struct wrn_dev *wrn);
+extern int wrn_ptp_index(struct wrn_dev *wrn);
+
+/* Following functions from timepage.c */
+extern int wrn_timepage_init(struct wrn_dev *wrn, struct device *parent);
+extern void wrn_timepage_exit(struct wrn_dev *wrn);
 
 /* Locally weak, designed for a mezzanine driver to implement */
 extern int wrn_mezzanine_ioctl(struct net_device *dev, struct ifreq *rq,
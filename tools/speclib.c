@@ -370,3 +370,32 @@ size_t spec_vuart_tx(void *card, char *buffer, size_t size)
 	return size;
 }
 
+/*
+ * The misc devices of wr-nic are children of the parent device of the
+ * interface, so they are listed in its "misc" directory in sysfs
+ */
+int spec_find_misc(const char *ifname, const char *prefix,
+		   char *devname, size_t size)
+{
+	char path[128];
+	struct dirent *de;
+	DIR *dir;
+	int ret = -1;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%.32s/device/misc",
+		 ifname);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, prefix, strlen(prefix)))
+			continue;
+		snprintf(devname, size, "/dev/%s", de->d_name);
+		ret = 0;
+		break;
+	}
+	closedir(dir);
+	if (ret)
+		errno = ENOENT;
+	return ret;
+}
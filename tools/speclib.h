@@ -53,6 +53,13 @@ enum {
 	BASE_BAR4 = 4	/* for gennum-internal registers */
 };
 
+/* Find the misc device of the card of interface [ifname], whose name
+   begins with [prefix] (e.g. "wr-time"), and return its "/dev/" path
+   in [devname]. Devices are named after the card, as interfaces may be
+   renamed. Returns 0 on success, -1 with errno set on failure. */
+int spec_find_misc(const char *ifname, const char *prefix,
+		   char *devname, size_t size);
+
 /* libspec version string */
 extern const char * const libspec_version_s;
 #endif
@@ -18,6 +18,7 @@
 #include <net/if.h>
 #include <net/ethernet.h>
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
 
 #include "net_tstamp.h" /* Actually, <linux/net_tstamp.h> */
 
@@ -39,6 +40,14 @@
 # define ETH_P_1588   0x88F7
 #endif
 
+#ifndef PACKET_TX_TIMESTAMP
+# define PACKET_TX_TIMESTAMP 16
+#endif
+
+#ifndef SO_EE_ORIGIN_TIMESTAMPING
+# define SO_EE_ORIGIN_TIMESTAMPING 4
+#endif
+
 static char git_version[] = "version: " GIT_VERSION;
 
 /* This structure is used to collect stamping information */
@@ -46,6 +55,8 @@ struct ts_data {
 	struct timespec ns;
 	struct timespec hw[3]; /* software, hw-sys, hw-raw */
 	int error;
+	int has_id;
+	unsigned int id; /* with SOF_TIMESTAMPING_OPT_ID */
 };
 
 /* We can print such stamp info. Returns -1 with errno set on error */
@@ -60,6 +71,8 @@ int print_stamp(FILE *out, char *prefix, struct ts_data *tstamp, FILE *err)
 		errno = tstamp->error;
 		return -1;
 	}
+	if (tstamp->has_id)
+		fprintf(out, "%s     id: %10u\n", prefix, tstamp->id);
 	fprintf(out, "%s     ns: %10li.%09li\n", prefix, tstamp->ns.tv_sec,
 		tstamp->ns.tv_nsec);
 	for (i = 0; i < 3; i++)
@@ -148,6 +161,17 @@ int make_stamping_socket(FILE *errchan, char *argv0, char *ifname,
 		close(sock);
 		return -1;
 	}
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING,
+		       &bits, sizeof(bits)) < 0 && errno == EINVAL
+	    && (bits & (SOF_TIMESTAMPING_OPT_ID
+			| SOF_TIMESTAMPING_OPT_TSONLY))) {
+		/* Older kernels: get back whole frames, not only stamps */
+		bits &= ~(SOF_TIMESTAMPING_OPT_ID
+			  | SOF_TIMESTAMPING_OPT_TSONLY);
+		if (errchan)
+			fprintf(errchan, "%s: no OPT_ID/OPT_TSONLY stamping, "
+				"using full frames\n", argv0);
+	}
 	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING,
 			       &bits, sizeof(bits)) < 0) {
 		if (errchan)
@@ -166,6 +190,7 @@ static void __collect_data(struct msghdr *msgp, struct ts_data *tstamp)
 {
 	struct cmsghdr *cm;
 	struct timespec *tsptr;
+	struct sock_extended_err *serr;
 
 	if (!tstamp)
 		return;
@@ -178,6 +203,15 @@ static void __collect_data(struct msghdr *msgp, struct ts_data *tstamp)
 			printf("level %i, type %i, len %zi\n", cm->cmsg_level,
 			       cm->cmsg_type, cm->cmsg_len);
 		}
+		/* With OPT_ID the error message carries the frame id */
+		if (cm->cmsg_level == SOL_PACKET
+		    && cm->cmsg_type == PACKET_TX_TIMESTAMP) {
+			serr = (void *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+				continue;
+			tstamp->has_id = 1;
+			tstamp->id = serr->ee_data;
+		}
 		if (cm->cmsg_level != SOL_SOCKET)
 			continue;
 		if (cm->cmsg_type == SO_TIMESTAMPNS)
@@ -189,10 +223,17 @@ static void __collect_data(struct msghdr *msgp, struct ts_data *tstamp)
 
 /*
  * These functions are like send/recv but handle stamping too.
+ * With SOF_TIMESTAMPING_OPT_TSONLY the error queue returns the stamp
+ * alone, without a copy of the frame; with OPT_ID the kernel numbers
+ * the frames of the socket, so we can skip stamps of earlier frames
+ * that came too late. Kernels that don't number them report 0 always.
  */
 ssize_t send_and_stamp(int sock, void *buf, size_t len, int flags,
 	struct ts_data *tstamp)
 {
+	static unsigned int next_id; /* we only use one socket */
+	static int ids_work;
+	struct ts_data local;
 	struct msghdr msg; /* this line and more from timestamping.c */
 	struct iovec entry;
 	struct sockaddr_ll from_addr;
@@ -201,45 +242,56 @@ ssize_t send_and_stamp(int sock, void *buf, size_t len, int flags,
 		char control[512];
 	} control;
 	char data[3*1024];
+	unsigned int id;
 	int i, j, ret;
 
 	ret = send(sock, buf, len, flags);
 	if (ret < 0)
 		return ret;
+	id = next_id++;
+	if (!tstamp)
+		tstamp = &local;
 
 	/* Then, get back from the error queue */
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_iov = &entry;
-	msg.msg_iovlen = 1;
-	entry.iov_base = data;
-	entry.iov_len = sizeof(data);
-	msg.msg_name = (caddr_t)&from_addr;
-	msg.msg_namelen = sizeof(from_addr);
-	msg.msg_control = &control;
-	msg.msg_controllen = sizeof(control);
-
 	j = 100; /* number of trials */
-	while ( (i = recvmsg(sock, &msg, MSG_ERRQUEUE)) < 0 && j--)
-		usleep(10000); /* retry for 1 second */
-	if (i < 0) {
-		if (tstamp) {
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &entry;
+		msg.msg_iovlen = 1;
+		entry.iov_base = data;
+		entry.iov_len = sizeof(data);
+		msg.msg_name = (caddr_t)&from_addr;
+		msg.msg_namelen = sizeof(from_addr);
+		msg.msg_control = &control;
+		msg.msg_controllen = sizeof(control);
+
+		i = recvmsg(sock, &msg, MSG_ERRQUEUE);
+		if (i < 0 && j--) {
+			usleep(10000); /* retry for 1 second */
+			continue;
+		}
+		if (i < 0) {
 			memset(tstamp, 0, sizeof(*tstamp));
 			tstamp->error = ETIMEDOUT;
+			return ret;
+		}
+		if (getenv("STAMP_VERBOSE")) {
+			int b;
+			printf("send %i =", i); /* 0 with OPT_TSONLY */
+			for (b = 0; b < i && b < 20; b++)
+				printf(" %02x", data[b] & 0xff);
+			putchar('\n');
 		}
-		return ret;
-	}
-	if (getenv("STAMP_VERBOSE")) {
-		int b;
-		printf("send %i =", i);
-		for (b = 0; b < i && b < 20; b++)
-			printf(" %02x", data[b] & 0xff);
-		putchar('\n');
-	}
-
-	/* FIX<E: Check that the actual data is what we sent */
 
-	__collect_data(&msg, tstamp);
+		/* FIX<E: Check that the actual data is what we sent */
 
+		__collect_data(&msg, tstamp);
+		if (tstamp->has_id && tstamp->id)
+			ids_work = 1;
+		if (!ids_work || tstamp->id == id)
+			break;
+		/* Otherwise, a late stamp of a previous frame: drop it */
+	}
 	return ret;
 }
 
@@ -413,7 +465,13 @@ int main(int argc, char **argv)
 	int sock;
 	unsigned char macaddr[6];
 	int listenmode = 0;
-	int howto = SOF_TIMESTAMPING_MASK; /* everything */
+	/*
+	 * Everything, but only get back the stamps of sent frames. No
+	 * software tx stamps: they come in another message with the same
+	 * id, and send_and_stamp() would take it for the hardware one.
+	 */
+	int howto = (SOF_TIMESTAMPING_MASK & ~SOF_TIMESTAMPING_TX_SOFTWARE)
+		| SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
 
 	if ((argc == 2) && (!strcmp(argv[1], "-V"))) {
 		print_version(argv[0]);
@@ -429,6 +487,8 @@ int main(int argc, char **argv)
 	 * SOF_TIMESTAMPING_SOFTWARE =   16,
 	 * SOF_TIMESTAMPING_SYS_HARDWARE = 32,
 	 * SOF_TIMESTAMPING_RAW_HARDWARE = 64,
+	 * SOF_TIMESTAMPING_OPT_ID = 128,
+	 * SOF_TIMESTAMPING_OPT_TSONLY = 2048,
 	 */
 
 	if (argc == 3 && !strcmp(argv[2], "listen")) {
@@ -441,7 +501,7 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	printf("%s: Using interface %s, with all timestamp options active\n",
+	printf("%s: Using interface %s, with hardware tx stamps only\n",
 	       argv[0], argv[1]);
 
 	/* Create a socket to use for stamping, use the library code above */
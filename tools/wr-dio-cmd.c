@@ -11,8 +11,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -20,6 +23,7 @@
 #include <net/if.h>
 #include <netpacket/packet.h>
 
+#include "speclib.h"
 #include "wr_nic/wr-nic.h"
 #include "wr-dio.h"
 
@@ -142,15 +146,18 @@ static int scan_pulse(int argc, char **argv)
 	return 0;
 }
 
+/* Five full rings at the default length: usually one call drains them */
+static struct wr_dio_stamp stamps[5 * WR_DIO_RING_LEN];
+
 static int scan_stamp(int argc, char **argv, int ismask)
 {
-	int i, ch;
+	struct wr_dio_stamps req;
+	int i, ch, wait = 0;
 	char c;
 
-	cmd->flags = 0;
-	if (argc == 3 && !strcmp(argv[2], "wait")) {
-		cmd->flags = WR_DIO_F_WAIT;
-		argc = 2;
+	if (argc >= 2 && !strcmp(argv[argc - 1], "wait")) {
+		wait = WR_DIO_F_WAIT;
+		argc--;
 	}
 	if (argc == 1) {
 		ismask = 1;
@@ -170,31 +177,77 @@ static int scan_stamp(int argc, char **argv, int ismask)
 		fprintf(stderr, "%s: %s: wrong number of arguments\n",
 			prgname, argv[0]);
 		if (ismask)
-			fprintf(stderr, "  Use: %s [<channel-mask>]\n",
+			fprintf(stderr, "  Use: %s [<channel-mask>] [wait]\n",
 				argv[0]);
 		else
 			fprintf(stderr, "  Use: %s [<channel>] [wait]\n",
 				argv[0]);
 		return -1;
 	}
-	if (ismask)
-		cmd->flags = WR_DIO_F_MASK;
-
+	/* Get all stamps at once, oldest first, whatever the channel */
 	while (1) {
-		cmd->channel = ch;
-		errno = 0;
-		ifr.ifr_data = (void *)cmd;
+		memset(&req, 0, sizeof(req));
+		req.command = WR_DIO_CMD_STAMPS;
+		req.channel = ismask ? ch : 1 << ch;
+		req.flags = wait;
+		req.nstamp = sizeof(stamps) / sizeof(stamps[0]);
+		req.stamps = (uintptr_t)stamps;
+		ifr.ifr_data = (void *)&req;
 		if (ioctl(sock, PRIV_MEZZANINE_CMD, &ifr) < 0 ) {
 			if (errno == EAGAIN)
 				break;
 			fprintf(stderr, "%s: ioctl(PRIV_MEZZANINE_CMD(%s)): "
 				"%s\n", prgname, ifname, strerror(errno));
+			return -1;
+		}
+		for (i = 0; i < req.nstamp; i++)
+			printf("ch %i, %9li.%09li\n", stamps[i].channel,
+			       (long)stamps[i].sec, (long)stamps[i].nsec);
+		if (!wait && req.nstamp < sizeof(stamps) / sizeof(stamps[0]))
+			break; /* drained */
+	}
+	return 0;
+}
+
+/* The counters are in the ring headers, so map them read-only */
+static int scan_stat(int argc, char **argv)
+{
+	struct wr_dio_ring *r;
+	char devname[64];
+	int ch, fd;
+
+	if (argc != 1) {
+		fprintf(stderr, "%s: %s: wrong number of arguments\n",
+			prgname, argv[0]);
+		return -1;
+	}
+	if (spec_find_misc(ifname, "wr-dio", devname, sizeof(devname))) {
+		fprintf(stderr, "%s: no DIO device for %s: %s\n", prgname,
+			ifname, strerror(errno));
 		return -1;
+	}
+	fd = open(devname, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", prgname, devname,
+			strerror(errno));
+		return -1;
+	}
+	for (ch = 0; ch < 5; ch++) {
+		r = mmap(NULL, sizeof(*r), PROT_READ, MAP_SHARED, fd,
+			 ch * getpagesize());
+		if (r == MAP_FAILED) {
+			fprintf(stderr, "%s: mmap(%s): %s\n", prgname,
+				devname, strerror(errno));
+			close(fd);
+			return -1;
 		}
-		for (i = 0; i < cmd->nstamp; i++)
-			printf("ch %i, %9li.%09li\n", cmd->channel,
-			       (long)cmd->t[i].tv_sec, cmd->t[i].tv_nsec);
+		printf("ch %i: len %u, pending %u, max %u, received %llu, "
+		       "dropped %llu\n", ch, r->len, r->head - r->tail,
+		       r->max_used, (unsigned long long)r->received,
+		       (unsigned long long)r->dropped);
+		munmap(r, sizeof(*r));
 	}
+	close(fd);
 	return 0;
 }
 
@@ -358,6 +411,7 @@ int main(int argc, char **argv)
 	 *
 	 * stamp [<channel>]
 	 * stampm [<mask>]
+	 * stat
 	 *
 	 * mode <01234>
 	 * mode <ch> <mode> [...]
@@ -374,6 +428,9 @@ int main(int argc, char **argv)
 		cmd->command = WR_DIO_CMD_STAMP;
 		if (scan_stamp(argc, argv, 1 /* mask */) < 0)
 			exit(1);
+	} else if (!strcmp(argv[0], "stat")) {
+		if (scan_stat(argc, argv) < 0)
+			exit(1);
 	} else if (!strcmp(argv[0], "mode")) {
 		cmd->command = WR_DIO_CMD_INOUT;
 		if (scan_inout(argc, argv) < 0)
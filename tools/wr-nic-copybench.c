@@ -0,0 +1,271 @@
+/*
+ * A benchmark for the frame copy loops of wr-nic (see nic-mem.h)
+ *
+ * Released to the public domain as sample code to be customized.
+ *
+ * This work is part of the White Rabbit project, a research effort led
+ * by CERN, the European Institute for Nuclear Research.
+ */
+
+/* Typical use: "rmmod wr-nic; wr-nic-copybench -n 100000" */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "speclib.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+
+/* The NIC is at 0x40000 in BAR0, its buffer memory at offset 0x8000 */
+#define CB_NIC_MEM	0x48000
+#define CB_DDATA_OFFSET	2 /* as WRN_DDATA_OFFSET in the driver */
+#define CB_MAXSIZE	2000
+
+/*
+ * The copy loops follow kernel/wr_nic/nic-mem.h: the "word" ones are the
+ * original loops (one unaligned access per word), the "fast" ones use the
+ * aligned path of the current driver, with 64-bit accesses (WRN_MMIO64)
+ * or without them. Arguments are in memcpy order.
+ */
+static void word_copy_out(volatile uint32_t *to, void *from, int size)
+{
+	uint32_t i;
+
+	from -= CB_DDATA_OFFSET;
+	size += CB_DDATA_OFFSET;
+	while (size > 0) {
+		memcpy(&i, from, sizeof(i));
+		*to = i;
+		to++; from += sizeof(i);
+		size -= sizeof(i);
+	}
+}
+
+static void word_copy_in(void *to, volatile uint32_t *from, int size)
+{
+	uint32_t i;
+
+	to -= CB_DDATA_OFFSET;
+	size += CB_DDATA_OFFSET;
+	while (size > 0) {
+		i = *from;
+		memcpy(to, &i, sizeof(i));
+		to += sizeof(i); from++;
+		size -= sizeof(i);
+	}
+}
+
+static void fast_copy_out(volatile uint32_t *to, void *from, int size,
+			  int use64)
+{
+	int nw;
+
+	from -= CB_DDATA_OFFSET;
+	size += CB_DDATA_OFFSET;
+	nw = (size + 3) / 4;
+
+	if (use64 && ((unsigned long)from & 7) == 0) {
+		volatile uint64_t *to64 = (void *)to;
+		uint64_t *from64 = from;
+
+		for (; nw >= 2; nw -= 2)
+			*to64++ = *from64++;
+		to = (void *)to64;
+		from = from64;
+	}
+	if (((unsigned long)from & 3) == 0) {
+		uint32_t *from32 = from;
+
+		while (nw--)
+			*to++ = *from32++;
+		return;
+	}
+	word_copy_out(to, from + CB_DDATA_OFFSET, nw * 4 - CB_DDATA_OFFSET);
+}
+
+static void fast_copy_in(void *to, volatile uint32_t *from, int size,
+			 int use64)
+{
+	int nw;
+
+	to -= CB_DDATA_OFFSET;
+	size += CB_DDATA_OFFSET;
+	nw = (size + 3) / 4;
+
+	if (use64 && ((unsigned long)to & 7) == 0) {
+		volatile uint64_t *from64 = (void *)from;
+		uint64_t *to64 = to;
+
+		for (; nw >= 2; nw -= 2)
+			*to64++ = *from64++;
+		from = (void *)from64;
+		to = to64;
+	}
+	if (((unsigned long)to & 3) == 0) {
+		uint32_t *to32 = to;
+
+		while (nw--)
+			*to32++ = *from++;
+		return;
+	}
+	word_copy_in(to + CB_DDATA_OFFSET, from, nw * 4 - CB_DDATA_OFFSET);
+}
+
+static double cb_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void cb_report(char *name, int size, int count, double t)
+{
+	printf("%-10s %8.1f MB/s  %8.0f ns/frame\n", name,
+	       (double)size * count / t / 1e6, t * 1e9 / count);
+}
+
+static void help(char *name)
+{
+	fprintf(stderr, "Use: \"%s [-V] [-b bus] [-d devfn] [-m] "
+		"[-o <offset>] [-s <size>] [-n <count>] [-a <align>]\"\n",
+		name);
+	fprintf(stderr, "   -m: use host memory, not the SPEC card\n"
+		"   -o: offset in BAR0 (default 0x%x, NIC buffer memory)\n"
+		"   -s: frame size (default 1500)\n"
+		"   -n: number of frames per test (default 10000)\n"
+		"   -a: skb data misalignment (default 2, as IP frames)\n",
+		CB_NIC_MEM);
+	fprintf(stderr, "Please unload wr-nic before running on a card.\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int bus = -1, dev_fn = -1, c, i;
+	int use_mem = 0, size = 1500, count = 10000, align = 2;
+	unsigned long offset = CB_NIC_MEM;
+	void *card = NULL, *map_base;
+	volatile uint32_t *nicmem;
+	uint8_t *txbuf, *rxbuf, *txdata, *rxdata;
+	double t;
+
+	while ((c = getopt(argc, argv, "b:d:mo:s:n:a:V")) != -1) {
+		switch (c) {
+		case 'b':
+			sscanf(optarg, "%i", &bus);
+			break;
+		case 'd':
+			sscanf(optarg, "%i", &dev_fn);
+			break;
+		case 'm':
+			use_mem = 1;
+			break;
+		case 'o':
+			sscanf(optarg, "%li", &offset);
+			break;
+		case 's':
+			sscanf(optarg, "%i", &size);
+			break;
+		case 'n':
+			sscanf(optarg, "%i", &count);
+			break;
+		case 'a':
+			sscanf(optarg, "%i", &align);
+			break;
+		case 'V':
+			printf("%s %s\n", argv[0], git_version);
+			printf("%s\n", libspec_version_s);
+			exit(0);
+		default:
+			help(argv[0]);
+		}
+	}
+	if (optind != argc || size < 1 || size > CB_MAXSIZE || count < 1
+	    || align < 0 || align > 7 || (offset & 7))
+		help(argv[0]);
+
+	if (use_mem) {
+		nicmem = aligned_alloc(8, CB_MAXSIZE + 8);
+	} else {
+		card = spec_open(bus, dev_fn);
+		if (!card) {
+			fprintf(stderr, "%s: No SPEC card at bus %i, "
+				"devfn %i\n", argv[0], bus, dev_fn);
+			fprintf(stderr, "  please make sure the address is "
+				"correct,\n  spec.ko is loaded and you run "
+				"as superuser.\n");
+			exit(1);
+		}
+		map_base = spec_get_base(card, BASE_BAR0);
+		if (!map_base || map_base == (void *) -1) {
+			fprintf(stderr, "%s: mmap(/dev/mem): %s\n", argv[0],
+				strerror(errno));
+			exit(1);
+		}
+		nicmem = map_base + offset;
+	}
+
+	/* Like skbs, data has headroom for the offset and tail slack */
+	txbuf = aligned_alloc(8, CB_MAXSIZE + 16);
+	rxbuf = aligned_alloc(8, CB_MAXSIZE + 16);
+	if (!nicmem || !txbuf || !rxbuf) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		exit(1);
+	}
+	txdata = txbuf + 8 + align - CB_DDATA_OFFSET;
+	/* In the driver, rx data minus the offset is always 8-aligned */
+	rxdata = rxbuf + 8 + CB_DDATA_OFFSET;
+	for (i = 0; i < size; i++)
+		txdata[i] = rand();
+
+	/* First check the fast loops against each other */
+	for (i = 0; i < 4; i++) {
+		fast_copy_out(nicmem, txdata, size, i & 1);
+		memset(rxbuf, 0, CB_MAXSIZE + 16);
+		fast_copy_in(rxdata, nicmem, size, i >> 1);
+		if (memcmp(txdata, rxdata, size)) {
+			fprintf(stderr, "%s: data mismatch (%i-bit out, "
+				"%i-bit in)\n", argv[0], i & 1 ? 64 : 32,
+				i >> 1 ? 64 : 32);
+			exit(1);
+		}
+	}
+
+	printf("frame size %i, %i frames, skb misalignment %i\n",
+	       size, count, align);
+	t = cb_now();
+	for (i = 0; i < count; i++)
+		word_copy_out(nicmem, txdata, size);
+	cb_report("out-word", size, count, cb_now() - t);
+	t = cb_now();
+	for (i = 0; i < count; i++)
+		fast_copy_out(nicmem, txdata, size, 0);
+	cb_report("out-fast32", size, count, cb_now() - t);
+	t = cb_now();
+	for (i = 0; i < count; i++)
+		fast_copy_out(nicmem, txdata, size, 1);
+	cb_report("out-fast64", size, count, cb_now() - t);
+
+	t = cb_now();
+	for (i = 0; i < count; i++)
+		word_copy_in(rxdata, nicmem, size);
+	cb_report("in-word", size, count, cb_now() - t);
+	t = cb_now();
+	for (i = 0; i < count; i++)
+		fast_copy_in(rxdata, nicmem, size, 0);
+	cb_report("in-fast32", size, count, cb_now() - t);
+	t = cb_now();
+	for (i = 0; i < count; i++)
+		fast_copy_in(rxdata, nicmem, size, 1);
+	cb_report("in-fast64", size, count, cb_now() - t);
+
+	if (card)
+		spec_close(card);
+	exit(0);
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2012 CERN (www.cern.ch)
+ *
+ * Released to the public domain as sample code to be customized.
+ *
+ * This work is part of the White Rabbit project, a research effort led
+ * by CERN, the European Institute for Nuclear Research.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "speclib.h"
+#include "wr-time.h"
+
+/*
+ * This maps the time page of wr-nic and prints White Rabbit time,
+ * computed from the host clock alone (no system calls but clock_gettime,
+ * that is served by the vDSO). Use "-n <count>" to print more samples.
+ */
+
+static char git_version[] = "version: " GIT_VERSION;
+
+static void help(char *name)
+{
+	fprintf(stderr, "Use: \"%s [-V] [-n <count>] [<ifname>]\"\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	volatile struct wr_time_page *page;
+	char *ifname = "wr0", devname[64];
+	int64_t host, wr;
+	struct timespec ts;
+	int c, fd, i, count = 1;
+
+	while ((c = getopt(argc, argv, "n:V")) != -1) {
+		switch (c) {
+		case 'n':
+			sscanf(optarg, "%i", &count);
+			break;
+		case 'V':
+			printf("%s %s\n", argv[0], git_version);
+			exit(0);
+		default:
+			help(argv[0]);
+		}
+	}
+	if (optind < argc - 1)
+		help(argv[0]);
+	if (optind == argc - 1)
+		ifname = argv[optind];
+
+	if (spec_find_misc(ifname, "wr-time", devname, sizeof(devname))) {
+		fprintf(stderr, "%s: no time page for %s: %s\n", argv[0],
+			ifname, strerror(errno));
+		exit(1);
+	}
+	fd = open(devname, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], devname,
+			strerror(errno));
+		exit(1);
+	}
+	page = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap(%s): %s\n", argv[0], devname,
+			strerror(errno));
+		exit(1);
+	}
+	close(fd);
+
+	for (i = 0; i < count; i++) {
+		if (i)
+			sleep(1);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		host = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+		wr = wr_time_page_ns(page, host);
+		if (wr < 0) {
+			fprintf(stderr, "%s: no WR time yet\n", argv[0]);
+			exit(1);
+		}
+		printf("wr time %lli.%09lli (offset %lli ns, rate %i ppb%s, "
+		       "%llu updates)\n",
+		       (long long)(wr / 1000000000LL),
+		       (long long)(wr % 1000000000LL),
+		       (long long)page->offset_ns, page->rate_ppb,
+		       page->flags & WR_TIME_F_RATE ? "" : " (unknown)",
+		       (unsigned long long)page->updates);
+	}
+	exit(0);
+}